@@ -0,0 +1,348 @@
+#include <stdio.h>
+#include <string.h>
+#include <errno.h>
+#include <sys/stat.h>
+
+#include "compress.h"
+#include "inode.h"
+#include "pages.h"
+#include "sizes.h"
+#include "util.h"
+#include "lz.h"
+
+/**
+ * A regular file with INODE_COMPRESS set (and too big to be inline)
+ * doesn't use the block pointers. Its contents are split into
+ * clusters, and each cluster is stored in as few pages as it
+ * compresses down to, or raw when compressing wouldn't save a page.
+ * Pages are only rewritten in place when no one else shares them, so
+ * snapshots see the old contents like they do for any other file
+ */
+
+// whether a file's contents are kept in compressed clusters
+int
+compress_active(inode* node)
+{
+    return S_ISREG(node->mode) && (node->flags & INODE_COMPRESS) &&
+           !(node->flags & INODE_INLINE) && node->cmap;
+}
+
+// gets the cluster map of a compressed file
+cluster*
+compress_map(inode* node)
+{
+    return pages_get_page(node->cmap);
+}
+
+// number of clusters holding bytes
+static
+int
+bytes_to_clusters(int bytes)
+{
+    return (bytes + CLUSTER_SIZE - 1) / CLUSTER_SIZE;
+}
+
+static
+int
+is_zero(const char* data, int bytes)
+{
+    for(int ii = 0; ii < bytes; ++ii) {
+        if(data[ii]) {
+            return 0;
+        }
+    }
+    return 1;
+}
+
+// the last cluster loaded or stored, reads and writes tend to come
+// in order so most of them find their cluster already decompressed.
+// anything past the end of the cluster's data is zeros. the cluster
+// is known by the pages it is in rather than by where its entry is,
+// a page isn't always at the same address from one operation to the
+// next
+static cluster cached;
+static int cached_ok = 0;
+static char cache[CLUSTER_SIZE];
+
+static
+int
+is_cached(const cluster* cl)
+{
+    return cached_ok && memcmp(cl, &cached, sizeof(cluster)) == 0;
+}
+
+static
+void
+set_cached(const cluster* cl)
+{
+    cached = *cl;
+    cached_ok = 1;
+}
+
+// decompresses a cluster into the cache
+static
+int
+cluster_load(cluster* cl)
+{
+    if(is_cached(cl)) {
+        return 0;
+    }
+
+    cached_ok = 0;
+    memset(cache, 0, CLUSTER_SIZE);
+    pages_advise_read(cl->pages, CLUSTER_PAGES);
+    if(cl->len == 0) {
+        for(int ii = 0; ii < CLUSTER_PAGES; ++ii) {
+            if(cl->pages[ii]) {
+                memcpy(cache + ii * page_size, pages_get_page(cl->pages[ii]), page_size);
+            }
+        }
+        set_cached(cl);
+        return 0;
+    }
+
+    char packed[CLUSTER_SIZE];
+    int npages = bytes_to_pages(cl->len);
+    for(int ii = 0; ii < npages; ++ii) {
+        memcpy(packed + ii * page_size, pages_get_page(cl->pages[ii]), page_size);
+    }
+    if(lz_decompress(packed, cl->len, cache, CLUSTER_SIZE) < 0) {
+        printf("+ cluster_load() corrupt cluster at page %d\n", cl->pages[0]);
+        memset(cache, 0, CLUSTER_SIZE);
+        return -EIO;
+    }
+    set_cached(cl);
+    return 0;
+}
+
+// gives back every page a cluster uses
+static
+void
+cluster_release(cluster* cl)
+{
+    if(is_cached(cl)) {
+        cached_ok = 0;
+    }
+    for(int ii = 0; ii < CLUSTER_PAGES; ++ii) {
+        if(cl->pages[ii]) {
+            free_page(cl->pages[ii]);
+        }
+    }
+    memset(cl, 0, sizeof(cluster));
+}
+
+// stores the first bytes of the cache as a cluster, compressed if
+// that takes fewer pages. on failure the cluster is left as it was
+static
+int
+cluster_store(cluster* cl, int bytes)
+{
+    memset(cache + bytes, 0, CLUSTER_SIZE - bytes);
+
+    // a cluster of zeros doesn't need any pages
+    if(is_zero(cache, bytes)) {
+        cluster_release(cl);
+        set_cached(cl);
+        return 0;
+    }
+
+    char packed[CLUSTER_SIZE];
+    int raw_pages = bytes_to_pages(bytes);
+    int len = 0;
+    if(raw_pages > 1) {
+        len = lz_compress(cache, bytes, packed, (raw_pages - 1) * page_size);
+    }
+    const char* src = len ? packed : cache;
+    int stored = len ? len : bytes;
+    int npages = bytes_to_pages(stored);
+
+    // pages no one else uses are rewritten in place, anything else
+    // gets a new page
+    int pages[CLUSTER_PAGES];
+    memset(pages, 0, sizeof(pages));
+    for(int ii = 0; ii < npages; ++ii) {
+        int old = cl->pages[ii];
+        int goal = ii ? pages[ii - 1] + 1 : pages_find(cl);
+        pages[ii] = (old && page_refs(old) == 1) ? old : alloc_page_near(goal);
+        if(pages[ii] < 0) {
+            for(int jj = 0; jj < ii; ++jj) {
+                if(pages[jj] != cl->pages[jj]) {
+                    free_page(pages[jj]);
+                }
+            }
+            cached_ok = 0;
+            return -ENOSPC;
+        }
+    }
+
+    for(int ii = 0; ii < CLUSTER_PAGES; ++ii) {
+        if(cl->pages[ii] && cl->pages[ii] != pages[ii]) {
+            free_page(cl->pages[ii]);
+        }
+    }
+
+    for(int ii = 0; ii < npages; ++ii) {
+        char* page = pages_get_page(pages[ii]);
+        int chunk = min(page_size, stored - ii * page_size);
+        memcpy(page, src + ii * page_size, chunk);
+        memset(page + chunk, 0, page_size - chunk);
+    }
+
+    memcpy(cl->pages, pages, sizeof(pages));
+    cl->len = len;
+    set_cached(cl);
+    return 0;
+}
+
+// switches a file over to compressed clusters (moving anything that
+// was inline into the first one) or grows one that already is
+int
+compress_grow(inode* node, int new_size)
+{
+    if(new_size > COMPRESS_MAX_SIZE) {
+        return -EFBIG;
+    }
+
+    // the cluster map overlaps inline data, so it only counts once
+    // the file is out of the inode
+    if((node->flags & INODE_INLINE) || node->cmap == 0) {
+        int cmap = alloc_page_near(pages_find(node));
+        if(cmap < 0) {
+            return -ENOSPC;
+        }
+        memset(pages_get_page(cmap), 0, page_size);
+
+        int loose = 0;
+        if(node->flags & INODE_INLINE) {
+            loose = node->size;
+            cached_ok = 0;
+            memcpy(cache, node->data, loose);
+        }
+
+        cluster* map = pages_get_page(cmap);
+        if(loose && cluster_store(&map[0], loose)) {
+            free_page(cmap);
+            return -ENOSPC;
+        }
+
+        // the cluster map shares space with the inline data
+        memset(node->data, 0, INODE_INLINE_SIZE);
+        node->flags &= ~INODE_INLINE;
+        node->cmap = cmap;
+    }
+
+    // the end of the last cluster was zeroed when it was stored, so
+    // growing is just a matter of the size
+    node->size = new_size;
+    return 0;
+}
+
+// cuts a compressed file down to new_size
+int
+compress_shrink(inode* node, int new_size)
+{
+    cluster* map = compress_map(node);
+    int keep = bytes_to_clusters(new_size);
+    int have = bytes_to_clusters(node->size);
+
+    // the new last cluster is stored again without what was cut off,
+    // so it reads back as zeros if the file grows
+    int tail = new_size % CLUSTER_SIZE;
+    if(tail) {
+        int rv = cluster_load(&map[keep - 1]);
+        if(!rv) {
+            rv = cluster_store(&map[keep - 1], tail);
+        }
+        if(rv) {
+            return rv;
+        }
+    }
+
+    for(int ii = keep; ii < have; ++ii) {
+        cluster_release(&map[ii]);
+    }
+    node->size = new_size;
+
+    if(new_size == 0) {
+        free_page(node->cmap);
+        node->cmap = 0;
+    }
+    return 0;
+}
+
+// reads from a compressed file, a cluster at a time
+int
+compress_read(inode* node, char* buf, size_t size, off_t offset)
+{
+    if(offset >= node->size) {
+        return 0;
+    }
+    size = min(size, node->size - offset);
+
+    cluster* map = compress_map(node);
+    int done = 0;
+    while(done < size) {
+        off_t pos = offset + done;
+        int coff = pos % CLUSTER_SIZE;
+        int bytes = min(CLUSTER_SIZE - coff, size - done);
+        int rv = cluster_load(&map[pos / CLUSTER_SIZE]);
+        if(rv) {
+            return done ? done : rv;
+        }
+        memcpy(buf + done, cache + coff, bytes);
+        done += bytes;
+    }
+    return done;
+}
+
+// writes into a compressed file that is already big enough, only
+// recompressing the clusters being written to
+int
+compress_write(inode* node, const char* buf, size_t size, off_t offset)
+{
+    cluster* map = compress_map(node);
+    int done = 0;
+    while(done < size) {
+        off_t pos = offset + done;
+        int index = pos / CLUSTER_SIZE;
+        int coff = pos % CLUSTER_SIZE;
+        int bytes = min(CLUSTER_SIZE - coff, size - done);
+        int valid = min(CLUSTER_SIZE, node->size - index * CLUSTER_SIZE);
+
+        // only a partial write needs what was there before
+        int rv = 0;
+        if(coff != 0 || bytes != valid) {
+            rv = cluster_load(&map[index]);
+        }
+        else {
+            cached_ok = 0;
+        }
+        if(!rv) {
+            memcpy(cache + coff, buf + done, bytes);
+            rv = cluster_store(&map[index], valid);
+        }
+        if(rv) {
+            return done ? done : rv;
+        }
+        done += bytes;
+    }
+    return done;
+}
+
+// calls fn for the cluster map page and every page holding clusters,
+// the same way inode_for_each_page does for the block pointers
+void
+compress_for_each_page(inode* node, inode_page_fn fn, void* arg)
+{
+    cluster* map = compress_map(node);
+    int nclusters = bytes_to_clusters(node->size);
+    for(int ii = 0; ii < nclusters; ++ii) {
+        for(int jj = 0; jj < CLUSTER_PAGES; ++jj) {
+            if(map[ii].pages[jj]) {
+                fn(node, map[ii].pages[jj], INODE_PAGE_DATA,
+                   ii * CLUSTER_PAGES + jj, arg);
+            }
+        }
+    }
+    fn(node, node->cmap, INODE_PAGE_INDIRECT, -1, arg);
+}
@@ -0,0 +1,29 @@
+#ifndef COMPRESS_H
+#define COMPRESS_H
+
+#include <sys/types.h>
+#include "inode.h"
+
+// compressed files are stored in clusters of a few pages, each one
+// compressed on its own so a write only has to redo the clusters it
+// touches. the inode's cluster map page says where each one went
+#define CLUSTER_PAGES 8
+#define CLUSTER_SIZE (CLUSTER_PAGES * 4096)
+
+typedef struct cluster {
+    int len; // bytes of compressed data, 0 if the pages hold it raw
+    int pages[CLUSTER_PAGES]; // 0 for a page of zeros
+} cluster;
+
+#define CLUSTERS_PER_MAP (4096 / sizeof(cluster))
+#define COMPRESS_MAX_SIZE (CLUSTERS_PER_MAP * CLUSTER_SIZE)
+
+int compress_active(inode* node);
+cluster* compress_map(inode* node);
+int compress_grow(inode* node, int new_size);
+int compress_shrink(inode* node, int new_size);
+int compress_read(inode* node, char* buf, size_t size, off_t offset);
+int compress_write(inode* node, const char* buf, size_t size, off_t offset);
+void compress_for_each_page(inode* node, inode_page_fn fn, void* arg);
+
+#endif
@@ -0,0 +1,97 @@
+#include <stdint.h>
+#include <string.h>
+
+#include "crc32c.h"
+
+// reflected Castagnoli polynomial
+#define CRC32C_POLY 0x82F63B78
+
+// tables for the fallback, table[k][b] being the crc of byte b
+// followed by k zero bytes, so 8 bytes can be done at a time
+static uint32_t crc_table[8][256];
+static int crc_hw = 0;
+
+static
+uint32_t
+crc32c_sw(uint32_t crc, const uint8_t* data, int len)
+{
+    while(len >= 8) {
+        uint64_t word;
+        memcpy(&word, data, sizeof(word));
+        word ^= crc;
+        crc = crc_table[7][word & 0xff] ^
+              crc_table[6][(word >> 8) & 0xff] ^
+              crc_table[5][(word >> 16) & 0xff] ^
+              crc_table[4][(word >> 24) & 0xff] ^
+              crc_table[3][(word >> 32) & 0xff] ^
+              crc_table[2][(word >> 40) & 0xff] ^
+              crc_table[1][(word >> 48) & 0xff] ^
+              crc_table[0][word >> 56];
+        data += 8;
+        len -= 8;
+    }
+    while(len-- > 0) {
+        crc = crc_table[0][(crc ^ *data++) & 0xff] ^ (crc >> 8);
+    }
+    return crc;
+}
+
+#if defined(__x86_64__)
+__attribute__((target("sse4.2")))
+static
+uint32_t
+crc32c_hw(uint32_t crc, const uint8_t* data, int len)
+{
+    uint64_t crc64 = crc;
+    while(len >= 8) {
+        uint64_t word;
+        memcpy(&word, data, sizeof(word));
+        crc64 = __builtin_ia32_crc32di(crc64, word);
+        data += 8;
+        len -= 8;
+    }
+    crc = crc64;
+    while(len-- > 0) {
+        crc = __builtin_ia32_crc32qi(crc, *data++);
+    }
+    return crc;
+}
+#endif
+
+// builds the tables and picks an implementation, has to be called
+// before crc32c is used
+void
+crc32c_init()
+{
+    for(int ii = 0; ii < 256; ++ii) {
+        uint32_t crc = ii;
+        for(int bit = 0; bit < 8; ++bit) {
+            crc = (crc >> 1) ^ ((crc & 1) ? CRC32C_POLY : 0);
+        }
+        crc_table[0][ii] = crc;
+    }
+    for(int ii = 0; ii < 256; ++ii) {
+        for(int kk = 1; kk < 8; ++kk) {
+            uint32_t prev = crc_table[kk - 1][ii];
+            crc_table[kk][ii] = crc_table[0][prev & 0xff] ^ (prev >> 8);
+        }
+    }
+
+#if defined(__x86_64__)
+    __builtin_cpu_init();
+    crc_hw = __builtin_cpu_supports("sse4.2");
+#endif
+}
+
+// continues crc over len bytes of data, start with a crc of 0
+uint32_t
+crc32c(uint32_t crc, const void* data, int len)
+{
+    crc = ~crc;
+#if defined(__x86_64__)
+    if(crc_hw) {
+        return ~crc32c_hw(crc, data, len);
+    }
+#endif
+    return ~crc32c_sw(crc, data, len);
+}
@@ -0,0 +1,12 @@
+#ifndef CRC32C_H
+#define CRC32C_H
+
+#include <stdint.h>
+
+// CRC-32C (Castagnoli), using the SSE4.2 crc32 instruction when the
+// cpu has it and a table otherwise
+
+void crc32c_init();
+uint32_t crc32c(uint32_t crc, const void* data, int len);
+
+#endif
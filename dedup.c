@@ -0,0 +1,165 @@
+#include <stdio.h>
+#include <string.h>
+#include <stdint.h>
+#include <sys/stat.h>
+
+#include "dedup.h"
+#include "inode.h"
+#include "compress.h"
+#include "pages.h"
+#include "bitmap.h"
+#include "sizes.h"
+
+/**
+ * Identical full data pages of regular files are merged into one
+ * page shared through the page reference counts, a write to a
+ * shared page copies it first like it does for clones. A page is
+ * only trusted to still match its index entry while its bit in the
+ * dedup bitmap is set, writing to it in place or freeing it clears
+ * the bit, so stale entries never have to be searched for
+ */
+
+static
+uint64_t
+rotl64(uint64_t x, int r)
+{
+    return (x << r) | (x >> (64 - r));
+}
+
+// fingerprints a page a word at a time
+uint64_t
+dedup_hash(const void* page)
+{
+    const uint64_t* words = page;
+    uint64_t hash = 0x27D4EB2F165667C5ull;
+    for(int ii = 0; ii < page_size / sizeof(uint64_t); ++ii) {
+        hash ^= words[ii] * 0x9E3779B97F4A7C15ull;
+        hash = rotl64(hash, 31) * 0xC2B2AE3D27D4EB4Full;
+    }
+
+    // mix the last word into all of the bits
+    hash ^= hash >> 33;
+    hash *= 0xFF51AFD7ED558CCDull;
+    hash ^= hash >> 33;
+    return hash;
+}
+
+// gets the index page, allocating it the first time it is needed
+static
+dedup_entry*
+dedup_table()
+{
+    superblock* sb = get_superblock();
+    if(sb->dedup_page == 0) {
+        int pnum = alloc_page();
+        if(pnum < 0) {
+            return 0;
+        }
+        memset(pages_get_page(pnum), 0, page_size);
+        sb->dedup_page = pnum;
+    }
+    return pages_get_page(sb->dedup_page);
+}
+
+// whether an entry still describes the contents of its page
+static
+int
+dedup_live(dedup_entry* entry)
+{
+    return entry->pnum && bitmap_get(get_dedup_bitmap(), entry->pnum);
+}
+
+// marks a page as no longer matching its fingerprint, called before
+// its contents are changed in place
+void
+dedup_forget(int pnum)
+{
+    bitmap_put(get_dedup_bitmap(), pnum, 0);
+}
+
+// looks up full data page index of an inode in the dedup index,
+// pointing the inode at an existing page with the same contents if
+// there is one and otherwise adding the page to the index. returns
+// 1 if a page was freed
+int
+dedup_page(inode* node, int index)
+{
+    int pnum = inode_get_pnum(node, index);
+    if(pnum == 0 || bitmap_get(get_dedup_bitmap(), pnum)) {
+        return 0;
+    }
+
+    dedup_entry* table = dedup_table();
+    if(table == 0) {
+        return 0;
+    }
+
+    // open addressing, entries that went stale are reused but never
+    // emptied so every probe sequence stays intact
+    void* page = pages_get_page(pnum);
+    uint64_t hash = dedup_hash(page);
+    dedup_entry* slot = 0;
+    for(int ii = 0; ii < DEDUP_SLOTS; ++ii) {
+        dedup_entry* entry = &table[(hash + ii) % DEDUP_SLOTS];
+        if(!dedup_live(entry)) {
+            if(slot == 0) {
+                slot = entry;
+            }
+            if(entry->pnum == 0) {
+                break;
+            }
+            continue;
+        }
+
+        if(entry->hash == hash && entry->pnum != pnum &&
+           memcmp(pages_get_page(entry->pnum), page, page_size) == 0 &&
+           page_ref(entry->pnum) == 0) {
+            printf("+ dedup_page(%d) %d -> %d\n", index, pnum, entry->pnum);
+            inode_set_pnum(node, index, entry->pnum);
+            free_page(pnum);
+            get_superblock()->dedup_merged += 1;
+            return 1;
+        }
+    }
+
+    // nothing to share with, remember this page for later writes
+    if(slot) {
+        slot->hash = hash;
+        slot->pnum = pnum;
+        bitmap_put(get_dedup_bitmap(), pnum, 1);
+    }
+    return 0;
+}
+
+// dedups every full data page of a regular file, returning the
+// number of pages freed
+int
+dedup_inode(inode* node)
+{
+    if(!S_ISREG(node->mode) || (node->flags & INODE_INLINE) ||
+       compress_active(node)) {
+        return 0;
+    }
+
+    int merged = 0;
+    int full = node->size / page_size;
+    for(int ii = 0; ii < full; ++ii) {
+        merged += dedup_page(node, ii);
+    }
+    return merged;
+}
+
+// runs over every file in the filesystem, returning the number of
+// pages freed
+int
+dedup_all()
+{
+    char* ibm = get_inode_bitmap();
+    int merged = 0;
+    for(int ii = 0; ii < num_inodes; ++ii) {
+        if(bitmap_get(ibm, ii)) {
+            merged += dedup_inode(get_inode(ii));
+        }
+    }
+    return merged;
+}
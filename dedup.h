@@ -0,0 +1,24 @@
+#ifndef DEDUP_H
+#define DEDUP_H
+
+#include <stdint.h>
+#include "inode.h"
+
+// the dedup index is a single page hash table from the fingerprint
+// of a full data page to the page holding those contents. entries
+// are hints, a page is only shared once its contents are compared
+typedef struct dedup_entry {
+    uint64_t hash; // fingerprint of the page contents
+    int pnum; // page with those contents, 0 if the slot was never used
+    int unused;
+} dedup_entry;
+
+#define DEDUP_SLOTS (4096 / sizeof(dedup_entry))
+
+uint64_t dedup_hash(const void* page);
+int dedup_page(inode* node, int index);
+int dedup_inode(inode* node);
+int dedup_all();
+void dedup_forget(int pnum);
+
+#endif
@@ -0,0 +1,177 @@
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <pthread.h>
+#include <sched.h>
+#include <unistd.h>
+
+#include "defrag.h"
+#include "inode.h"
+#include "compress.h"
+#include "storage.h"
+#include "pages.h"
+#include "bitmap.h"
+#include "sizes.h"
+#include "util.h"
+
+/**
+ * Pages are allocated lowest free page first, so after a while a
+ * file's pages end up spread over the image. Defragmenting a file
+ * copies its data pages into the lowest run of free pages that holds
+ * all of them. Pages shared with clones, snapshots or dedup stay
+ * where they are since they can't be repointed from one place.
+ * Compacting also moves files that are already in one piece if a run
+ * lower down fits them, so free space collects at the end of the
+ * image. Like everything else this happens inside a single storage
+ * operation, so readers never see a file half moved
+ */
+
+typedef struct defrag_list {
+    int count;
+    int* pnums; // pages that can be moved, in file order
+    int* index; // where in the file each one is
+} defrag_list;
+
+static
+void
+list_page(inode* node, int pnum, int kind, int index, void* arg)
+{
+    defrag_list* list = arg;
+    if(kind != INODE_PAGE_DATA || page_refs(pnum) != 1) {
+        return;
+    }
+    if(list->pnums) {
+        list->pnums[list->count] = pnum;
+        list->index[list->count] = index;
+    }
+    list->count += 1;
+}
+
+// the first page of the lowest run of count free pages outside any
+// reservation window, -1 if there isn't one
+static
+int
+find_run(int count)
+{
+    void* pbm = get_pages_bitmap();
+    int run = 0;
+    for(int ii = 1; ii < num_pages; ++ii) {
+        // windows are kept for files still being written
+        int used = bitmap_get(pbm, ii) || pages_reserved(ii);
+        run = used ? 0 : run + 1;
+        if(run == count) {
+            return ii - count + 1;
+        }
+    }
+    return -1;
+}
+
+// copies page index of a file from one page to another
+static
+void
+move_page(inode* node, int index, int from, int to)
+{
+    memcpy(pages_get_page(to), pages_get_page(from), page_size);
+    if(compress_active(node)) {
+        cluster* map = compress_map(node);
+        map[index / CLUSTER_PAGES].pages[index % CLUSTER_PAGES] = to;
+    }
+    else {
+        inode_set_pnum(node, index, to);
+    }
+    free_page(from);
+}
+
+// puts a file's pages in one run, with compact set moving it lower
+// down even if it already is. returns the number of pages moved
+int
+defrag_inode(inode* node, int compact)
+{
+    defrag_list list = { 0, 0, 0 };
+    inode_for_each_page(node, list_page, &list);
+    int count = list.count;
+    if(count == 0) {
+        return 0;
+    }
+
+    list.pnums = malloc(count * sizeof(int));
+    list.index = malloc(count * sizeof(int));
+    list.count = 0;
+    inode_for_each_page(node, list_page, &list);
+
+    int in_order = 1;
+    for(int ii = 1; ii < count; ++ii) {
+        in_order = in_order && list.pnums[ii] == list.pnums[0] + ii;
+    }
+
+    int moved = 0;
+    int start = find_run(count);
+    if(start < 0) {
+        moved = in_order ? 0 : -ENOSPC;
+    }
+    else if(!in_order || (compact && start < list.pnums[0])) {
+        for(int ii = 0; ii < count; ++ii) {
+            alloc_page_at(start + ii);
+            move_page(node, list.index[ii], list.pnums[ii], start + ii);
+        }
+        printf("+ defrag_inode() %d pages to %d\n", count, start);
+        moved = count;
+    }
+
+    free(list.pnums);
+    free(list.index);
+    return moved;
+}
+
+// defragments and compacts every file, returning the pages moved
+int
+defrag_all()
+{
+    char* ibm = get_inode_bitmap();
+    int moved = 0;
+    for(int ii = 0; ii < num_inodes; ++ii) {
+        // orphans are only waiting for their pages to be freed
+        if(bitmap_get(ibm, ii) && get_inode(ii)->refs > 0) {
+            moved += max(defrag_inode(get_inode(ii), 1), 0);
+        }
+    }
+    return moved;
+}
+
+static
+void*
+defrag_main(void* arg)
+{
+    int interval = *(int*)arg;
+
+    struct sched_param param = { 0 };
+    pthread_setschedparam(pthread_self(), SCHED_IDLE, &param);
+
+    for(;;) {
+        sleep(interval);
+        storage_begin();
+        int moved = storage_defrag("/");
+        storage_end(moved);
+    }
+    return 0;
+}
+
+// runs defrag_all every interval seconds in the background
+void
+defrag_start(int interval)
+{
+    static int defrag_interval;
+    pthread_t thread;
+    if(interval <= 0) {
+        return;
+    }
+
+    defrag_interval = interval;
+    if(pthread_create(&thread, 0, defrag_main, &defrag_interval)) {
+        perror("nufs: defrag");
+        return;
+    }
+    pthread_detach(thread);
+}
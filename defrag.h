@@ -0,0 +1,10 @@
+#ifndef DEFRAG_H
+#define DEFRAG_H
+
+#include "inode.h"
+
+int defrag_inode(inode* node, int compact);
+int defrag_all();
+void defrag_start(int interval);
+
+#endif
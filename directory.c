@@ -1,5 +1,6 @@
+#include <stdio.h>
+#include <stdlib.h>
 #include <string.h>
-#include <bsd/string.h>
 #include <errno.h>
 
 #include "directory.h"
@@ -7,76 +8,132 @@
 #include "util.h"
 #include "sizes.h"
 
-static const int ents_per_page = (page_size / sizeof(dirent));
-
 // initializes the root ("/") directory
 void directory_init()
 {
+    superblock* sb = get_superblock();
     char* inode_bm = get_inode_bitmap();
     // check if this is a fs 
-    for(int ii = 0; ii < inode_end_page; ++ii) {
-        if(bitmap_get(inode_bm, ii)) {
-            return;
-        }
+    if(sb->magic == nufs_magic && sb->version == nufs_version) {
+        return;
+    }
+
+    // refuse to reformat over an image using some other layout
+    if(sb->magic == nufs_magic || bitmap_get(inode_bm, root_inode)) {
+        fprintf(stderr, "nufs: image has an unsupported layout\n");
+        exit(1);
     }
     
     // must be a fresh filesystem, lets initialize
     memset(pages_get_page(0), 0, page_size);
-    // allocating pages for inodes
-    for(int ii = inode_start_page; ii < inode_end_page; ++ii) {
-        alloc_page();
+    bitmap_put(get_pages_bitmap(), 0, 1);
+    sb->free_pages = num_pages - 1;
+    sb->free_inodes = num_inodes;
+    alloc_group* groups = get_groups();
+    for(int ii = 0; ii < num_groups; ++ii) {
+        groups[ii].free_pages = pages_per_group;
+        groups[ii].free_inodes = inodes_per_group;
     }
-    alloc_inode(); // allocate inode for root dir always inode 0
+    groups[0].free_pages -= 1;
+    sb->magic = nufs_magic;
+    sb->version = nufs_version;
+
+    // whatever the other pages hold is free space now, with checksums
+    // matching it the root can be made like anything else
+    pages_checksum_all();
+    pages_begin();
+    alloc_inode(-1, 040755); // allocate inode for root dir always inode 0
     inode* root_inode = get_inode(0);
     root_inode->mode = 040755;
     root_inode->size = 0;
     root_inode->refs = 1;
+    pages_end();
 }
 
-// given a page of dirents, returns the inum of an entry with 
-// inode node name, -1 if none found
+// bytes a record holding a name of length name_len takes up
 static
 int
-page_find_name(void* page, const char* name, int size)
+dirent_size(int name_len)
 {
-    dirent* entries = (dirent*)page;
-    for(int ii = 0; ii < size; ++ii) {
-        if(streq(entries[ii].name, name)) {
-            return entries[ii].inum;
-        }
+    int size = sizeof(dirent) + name_len + 1;
+    return (size + 3) & ~3;
+}
+
+// FNV-1a hash of a name, stored with each entry so most
+// mismatches are rejected without comparing strings
+uint32_t
+name_hash(const char* name)
+{
+    uint32_t hash = 2166136261u;
+    for(; *name; ++name) {
+        hash ^= (uint8_t)*name;
+        hash *= 16777619u;
     }
-    return -1;
+    return hash;
 }
 
-// finds the index of the dirent with name and returns the index
-// in the page, -1 otherwise
+// entries in a page run from page_first up to page_end
 static
+dirent*
+page_first(dirpage* pg)
+{
+    return (dirent*)(pg + 1);
+}
+
+static
+dirent*
+page_end(dirpage* pg)
+{
+    return (dirent*)((char*)pg + pg->used);
+}
+
+static
+dirent*
+page_next(dirent* ent)
+{
+    return (dirent*)((char*)ent + ent->len);
+}
+
+// nonzero if the header of a directory page can be trusted to walk it
 int
-page_find_name_index(void* page, const char* name, int size)
+dirpage_valid(dirpage* pg)
 {
-    dirent* entries = (dirent*)page;
-    for(int ii = 0; ii < size; ++ii) {
-        if(streq(entries[ii].name, name)) {
-            return ii;
-        }
-    }
-    return -1;
+    return pg && pg->used >= (int)sizeof(dirpage) && pg->used <= page_size;
 }
 
-// for a given page index in a directory, return how
-// many dirents are in that page
+// nonzero if ent, somewhere in the used part of a valid page pg, is a
+// whole entry that ends before the page does. nothing past an entry
+// that isn't can be trusted, so walkers stop there with -EIO
+int
+dirent_valid(dirpage* pg, dirent* ent)
+{
+    int left = (char*)page_end(pg) - (char*)ent;
+    return left >= (int)sizeof(dirent) && ent->name_len <= DIR_NAME &&
+           ent->len >= dirent_size(ent->name_len) && ent->len <= left &&
+           memchr(ent->name, 0, ent->name_len + 1) == ent->name + ent->name_len;
+}
+
+// given a page of dirents, finds the entry with name, returning 0 and
+// setting found (0 if there is no such entry) or -EIO
 static
 int
-directory_page_length(inode* dd, int index)
+page_find_name(dirpage* pg, const char* name, int name_len, uint32_t hash,
+               dirent** found)
 {
-    int num_ents = dd->size / sizeof(dirent);
-    int last_page = dd->size / page_size;
-    if(index < last_page) {
-        return ents_per_page;
+    *found = 0;
+    if(!dirpage_valid(pg)) {
+        return -EIO;
     }
-    else {
-        return num_ents - (ents_per_page * last_page);
+    for(dirent* ent = page_first(pg); ent < page_end(pg); ent = page_next(ent)) {
+        if(!dirent_valid(pg, ent)) {
+            return -EIO;
+        }
+        if(ent->hash == hash && ent->name_len == name_len && streq(ent->name, name)) {
+            *found = ent;
+            return 0;
+        }
     }
+    return 0;
 }
 
 // for a given directory return the number of pages used
@@ -85,43 +142,59 @@ static
 int
 directory_num_pages(inode* dd)
 {
-    int npages = dd->size / page_size;
-    if(dd->size > (npages * page_size)) {
-        npages += 1;
-    }
-
-    return npages;
+    return dd->size / page_size;
 }
 
-
-// looks in the directory inode dd, looking for name
-// returning 'names's inode index
-int 
-directory_lookup(inode* dd, const char* name)
+// looks through every page of directory dd for name, setting found to
+// the entry and filling in the page and page index it was found in.
+// returns -ENOENT if it isn't there, -EIO if a page is broken
+static
+int
+directory_find(inode* dd, const char* name, dirent** found, dirpage** page, int* index)
 {
-    // get the number of entries, and therefore the number of 
-    // pages used to store all directory entries
+    int name_len = strlen(name);
+    if(name_len > DIR_NAME) {
+        return -ENOENT;
+    }
+    uint32_t hash = name_hash(name);
+
     int dir_pages = directory_num_pages(dd);
-    
-    // go through directory entry pages looking for name 
-    char* curr_dir_page = 0;
     for(int ii = 0; ii < dir_pages; ++ii) {
-        curr_dir_page = inode_get_page(dd, ii);
-        if(curr_dir_page == 0) { 
+        dirpage* pg = inode_get_page(dd, ii);
+        if(pg == 0) {
             return -EIO;
         }
-        
-        // use the specified page to look for name
-        int arr_size = directory_page_length(dd, ii);
-        int inode = page_find_name(curr_dir_page, name, arr_size);
-        if(inode > 0) {
-            // we found the name, return it's inode
-            return inode;
+
+        int rv = page_find_name(pg, name, name_len, hash, found);
+        if(rv) {
+            return rv;
+        }
+        if(*found) {
+            if(page) {
+                *page = pg;
+            }
+            if(index) {
+                *index = ii;
+            }
+            return 0;
         }
     }
     return -ENOENT;
 }
 
+// looks in the directory inode dd, looking for name
+// returning 'names's inode index
+int 
+directory_lookup(inode* dd, const char* name)
+{
+    dirent* ent;
+    int rv = directory_find(dd, name, &ent, 0, 0);
+    if(rv) {
+        return rv;
+    }
+    return ent->inum;
+}
+
 
 // looks up path starting from the root node, in a tree way, returning
 // the inode index corresponding to path's parent dir
@@ -138,7 +211,7 @@ tree_lookup(const char* path)
         inode* node = get_inode(iwalk);
         iwalk = directory_lookup(node, swalk->data);
         if(iwalk < 0) {
-            return iwalk;
+            break;
         }
         swalk = swalk->next;
     }
@@ -153,11 +226,11 @@ tree_lookup(const char* path)
 int 
 directory_put(inode* dd, const char* name, int inum)
 {
-    // grow directory to fit another dirent
-    int rv = grow_inode(dd, sizeof(dirent));
-    if(rv){
-        return rv;
+    int name_len = strlen(name);
+    if(name_len > DIR_NAME) {
+        return -ENAMETOOLONG;
     }
+    int len = dirent_size(name_len);
 
     // get the inode corresponing to inum
     inode* node = get_inode(inum);
@@ -165,114 +238,227 @@ directory_put(inode* dd, const char* name, int inum)
         return -ENOENT;
     }
 
-    // get index and index of page to use for new entry
-    int num_ents = dd->size / sizeof(dirent);
-    int new_ind = num_ents - 1;
-    int page_ind = (new_ind / ents_per_page);
-    
-    dirent* dir_page = inode_get_page(dd, page_ind);
+    // find the first page with enough room left for the entry
+    dirpage* pg = 0;
+    int dir_pages = directory_num_pages(dd);
+    for(int ii = 0; ii < dir_pages; ++ii) {
+        dirpage* curr = inode_get_page(dd, ii);
+        if(!dirpage_valid(curr)) {
+            return -EIO;
+        }
+        if((page_size - curr->used) >= len) {
+            pg = curr;
+            break;
+        }
+    }
 
-    dirent* entry = &dir_page[new_ind % ents_per_page];
-    strlcpy(entry->name, name, DIR_NAME);
+    // all full, grow directory by another page
+    if(pg == 0) {
+        int rv = grow_inode(dd, -1, page_size);
+        if(rv){
+            return rv;
+        }
+        pg = inode_get_page(dd, dir_pages);
+        pg->used = sizeof(dirpage);
+        pg->count = 0;
+    }
+
+    // entries are always appended to the end of the page
+    dirent* entry = page_end(pg);
+    memset(entry, 0, len);
+    entry->len = len;
+    entry->name_len = name_len;
     entry->inum = inum;
+    entry->hash = name_hash(name);
+    memcpy(entry->name, name, name_len + 1);
+    pg->used += len;
+    pg->count += 1;
+
     node->refs += 1;
     return 0;
 }
 
+// removes an entry from page index of directory dd, compacting the
+// rest of the page over it. an emptied page is replaced by the last
+// page so directories never have holes
+static
+int
+directory_remove(inode* dd, dirpage* pg, int index, dirent* ent)
+{
+    int len = ent->len;
+    char* next = (char*)page_next(ent);
+    memmove(ent, next, (char*)page_end(pg) - next);
+    pg->used -= len;
+    pg->count -= 1;
+    memset(page_end(pg), 0, len);
+
+    if(pg->count > 0) {
+        return 0;
+    }
+
+    int last = directory_num_pages(dd) - 1;
+    if(index != last) {
+        memcpy(pg, inode_get_page(dd, last), page_size);
+    }
+    return shrink_inode(dd, page_size);
+}
+
 // deletes the specified name from the directory
 int 
 directory_delete(inode* dd, const char* name)
 {
-    int num_ents = dd->size / sizeof(dirent);
-    int dir_pages = directory_num_pages(dd);
-    
-    // if there are no entry's this always fails
-    if(num_ents == 0) {
-        return -ENOENT;
+    dirpage* pg;
+    int index;
+    dirent* ent;
+    int rv = directory_find(dd, name, &ent, &pg, &index);
+    if(rv) {
+        return rv;
     }
 
-    if(dd->iptr) {
-        int* iptrs = pages_get_page(dd->iptr);
+    // need to free the inode
+    rv = free_inode(ent->inum);
+    if(rv) {
+        return rv;
     }
-    
-    // can remove a directory entry by swapping the last entry with
-    // the entry with 'name' and then deleting the last entry
-    char* curr_page = 0;
-    int find = 0;
 
-    // look for entry in all pages
-    for(int ii = 0; ii < dir_pages; ++ii) {
-        curr_page = inode_get_page(dd, ii);
-        if(curr_page == 0){
-            return -EIO;
-        }
-        
-        int arr_size = directory_page_length(dd, ii);
-        find = page_find_name_index(curr_page, name, arr_size);
+    return directory_remove(dd, pg, index, ent);
+}
 
-        if(find >= 0) {
-            break;
-        }
+
+// rewrites the name of an entry in place, sliding the rest of the
+// page to make room. returns 0 on success, -1 if it doesn't fit
+static
+int
+page_rename(dirpage* pg, dirent* ent, const char* name)
+{
+    int name_len = strlen(name);
+    int len = dirent_size(name_len);
+    int delta = len - ent->len;
+    if(delta > (page_size - pg->used)) {
+        return -1;
     }
 
-    // never found the entry
-    if(find < 0) {
-        return -ENOENT;
+    char* next = (char*)page_next(ent);
+    memmove(next + delta, next, (char*)page_end(pg) - next);
+    pg->used += delta;
+    if(delta < 0) {
+        memset(page_end(pg), 0, -delta);
     }
 
-    // we have the page and index of the entry to remove, just get the 
-    // last entry and puts its contents into the one to be removed then
-    // then shrink
-    int last_page_index = directory_page_length(dd, dir_pages-1) - 1;
-    dirent* last_page = inode_get_page(dd, dir_pages-1);
-    dirent* last =  last_page + last_page_index;
-    dirent* remove = (dirent*)curr_page + find;
+    ent->len = len;
+    ent->name_len = name_len;
+    ent->hash = name_hash(name);
+    memset(ent->name, 0, len - sizeof(dirent));
+    memcpy(ent->name, name, name_len + 1);
+    return 0;
+}
 
-    // need to free the inode
-    int rv = free_inode(get_inode(remove->inum));
+// moves the entry from_name in from_dd to to_name in to_dd, replacing
+// whatever to_name referred to. each directory is searched once, and
+// the moved inode's reference count is never touched
+int
+directory_rename(inode* from_dd, const char* from_name,
+                 inode* to_dd, const char* to_name)
+{
+    if(strlen(to_name) > DIR_NAME) {
+        return -ENAMETOOLONG;
+    }
+
+    dirpage* from_pg;
+    int from_index;
+    dirent* from;
+    int rv = directory_find(from_dd, from_name, &from, &from_pg, &from_index);
     if(rv) {
         return rv;
     }
-    
-    // move last inodes contents to the entry that's being removed
-    memmove(remove, last, sizeof(dirent));
-    // just in case
-    memset(last, 0, sizeof(dirent));
+    int inum = from->inum;
+
+    dirent* to;
+    rv = directory_find(to_dd, to_name, &to, 0, 0);
+    if(rv == -EIO) {
+        return rv;
+    }
+    if(rv == 0) {
+        // renaming a link onto another link of the same inode is a no-op
+        if(to->inum == inum) {
+            return 0;
+        }
 
-    return shrink_inode(dd, sizeof(dirent));
+        inode* moving = get_inode(inum);
+        inode* replaced = get_inode(to->inum);
+        if(S_ISDIR(replaced->mode)) {
+            if(!S_ISDIR(moving->mode)) {
+                return -EISDIR;
+            }
+            if(replaced->size > 0) {
+                return -ENOTEMPTY;
+            }
+        }
+        else if(S_ISDIR(moving->mode)) {
+            return -ENOTDIR;
+        }
+
+        // the name never stops existing, it just points somewhere new
+        int replaced_inum = to->inum;
+        to->inum = inum;
+        free_inode(replaced_inum);
+        return directory_remove(from_dd, from_pg, from_index, from);
+    }
+
+    // same directory, just change the name
+    if(from_dd == to_dd && page_rename(from_pg, from, to_name) == 0) {
+        return 0;
+    }
+
+    // add the new name before dropping the old, directory_put takes a
+    // reference that the old name is giving up
+    rv = directory_put(to_dd, to_name, inum);
+    if(rv) {
+        return rv;
+    }
+    get_inode(inum)->refs -= 1;
+    return directory_remove(from_dd, from_pg, from_index, from);
 }
 
 
-// returns a string list of all the inode names inside the 
-// specified directory
-slist* 
-directory_list(const char* path)
+// sets list to a string list of all the inode names inside the
+// specified directory, returning -EIO and no list if a page is broken
+int
+directory_list(const char* path, slist** list)
 {
+    *list = 0;
+
     // get the inode of the directory
     int inode_index = tree_lookup(path);
     if(inode_index < 0) {
-        return 0;
+        return inode_index;
     }
 
     inode* dir_node = get_inode(inode_index);
     if(dir_node == 0) {
-        return 0;
+        return -ENOENT;
     }
     
     // loop through all pages of dirent, getting names
     int num_pages = directory_num_pages(dir_node);
-    dirent* dirents;
-    int length;
-    slist* list = 0;
+    slist* names = 0;
     for(int page_index = 0; page_index < num_pages; ++page_index) {
-        dirents = inode_get_page(dir_node, page_index);
-        length = directory_page_length(dir_node, page_index);
-        for(int ii = 0; ii < length; ++ii) {
-            list = s_cons(dirents[ii].name, list);
+        dirpage* pg = inode_get_page(dir_node, page_index);
+        if(!dirpage_valid(pg)) {
+            s_free(names);
+            return -EIO;
+        }
+        for(dirent* ent = page_first(pg); ent < page_end(pg); ent = page_next(ent)) {
+            if(!dirent_valid(pg, ent)) {
+                s_free(names);
+                return -EIO;
+            }
+            names = s_cons(ent->name, names);
         }
     }
 
-    return list;
+    *list = names;
+    return 0;
 }
 
 
@@ -280,20 +466,22 @@ directory_list(const char* path)
 void 
 print_directory(inode* dd)
 {
-    int num_ents = dd->size / sizeof(dirent);
     int num_pages = directory_num_pages(dd);
 
     for(int ii = 0; ii < num_pages; ++ii) {
-        dirent* curr_page = (dirent*)inode_get_page(dd, ii);
-        if(curr_page) {
-            for(int jj = 0; jj < ents_per_page; ++jj) {
-                printf("%5d: %28s, %3d\n", 
-                        (ii * ents_per_page) + jj,
-                        curr_page[jj].name,
-                        curr_page[jj].inum);
+        dirpage* pg = inode_get_page(dd, ii);
+        if(!dirpage_valid(pg)) {
+            printf("page %d: bad header\n", ii);
+            continue;
+        }
+        printf("page %d: %d entries, %d bytes used\n", ii, pg->count, pg->used);
+        for(dirent* ent = page_first(pg); ent < page_end(pg); ent = page_next(ent)) {
+            if(!dirent_valid(pg, ent)) {
+                printf("corrupt entry at %d\n", (int)((char*)ent - (char*)pg));
+                break;
             }
+            printf("%28s, %3d (%08x)\n", ent->name, ent->inum, ent->hash);
         }
     }
     printf("\n");
 }
-
@@ -3,25 +3,41 @@
 #ifndef DIRECTORY_H
 #define DIRECTORY_H
 
-#define DIR_NAME (64 - sizeof(int))
+#include <stdint.h>
 
 #include "slist.h"
 #include "pages.h"
 #include "inode.h"
 
+// longest name a directory entry can hold
+#define DIR_NAME 255
+
+// every directory page starts with this header, followed by
+// variable length entries packed one after another
+typedef struct dirpage {
+    int used; // bytes in use, including this header
+    int count; // number of entries in the page
+} dirpage;
+
 typedef struct dirent {
-    char name[DIR_NAME];
-    int  inum;
-    //char _reserved[12];
+    uint16_t len; // record length, name padded out to 4 bytes
+    uint16_t name_len; // length of name, not counting the '\0'
+    int      inum;
+    uint32_t hash; // hash of name, checked before comparing names
+    char     name[]; // '\0' terminated
 } dirent;
 
 void directory_init();
+uint32_t name_hash(const char* name);
 int directory_lookup(inode* dd, const char* name);
 int tree_lookup(const char* path);
 int directory_put(inode* dd, const char* name, int inum);
 int directory_delete(inode* dd, const char* name);
-slist* directory_list(const char* path);
+int directory_rename(inode* from_dd, const char* from_name,
+                     inode* to_dd, const char* to_name);
+int directory_list(const char* path, slist** list);
+int dirpage_valid(dirpage* pg);
+int dirent_valid(dirpage* pg, dirent* ent);
 void print_directory(inode* dd);
 
 #endif
-
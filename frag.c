@@ -0,0 +1,116 @@
+#include <stdio.h>
+#include <string.h>
+#include <errno.h>
+
+#include "frag.h"
+#include "pages.h"
+#include "sizes.h"
+
+// mask covering nslots slots starting at slot
+static
+int
+slot_mask(int slot, int nslots)
+{
+    return ((1 << nslots) - 1) << slot;
+}
+
+// number of slots needed to hold bytes
+int
+frag_slots(int bytes)
+{
+    return (bytes + FRAG_SLOT_SIZE - 1) / FRAG_SLOT_SIZE;
+}
+
+// finds nslots free contiguous slots in a fragment page, returning
+// the first slot or -1 if there isn't room
+static
+int
+page_find_slots(frag_header* hdr, int nslots)
+{
+    for(int ii = 1; ii + nslots <= FRAG_SLOTS; ++ii) {
+        if((hdr->used & slot_mask(ii, nslots)) == 0) {
+            return ii;
+        }
+    }
+    return -1;
+}
+
+// allocates nslots contiguous slots, filling in the fragment page
+// they came from and returning the first slot
+int
+frag_alloc(int nslots, int* pnum)
+{
+    superblock* sb = get_superblock();
+
+    // try to use the fragment page we are currently filling
+    if(sb->frag_page) {
+        frag_header* hdr = pages_get_page(sb->frag_page);
+        int slot = page_find_slots(hdr, nslots);
+        if(slot >= 0) {
+            hdr->used |= slot_mask(slot, nslots);
+            *pnum = sb->frag_page;
+            return slot;
+        }
+    }
+
+    // start filling a new fragment page
+    int page = alloc_page();
+    if(page < 0) {
+        return -ENOSPC;
+    }
+    memset(pages_get_page(page), 0, page_size);
+    frag_header* hdr = pages_get_page(page);
+    hdr->used = slot_mask(0, 1 + nslots);
+    printf("+ frag_alloc(%d) -> new page %d\n", nslots, page);
+
+    sb->frag_page = page;
+    *pnum = page;
+    return 1;
+}
+
+// tries to grow a slot run in place, returns 0 if successful
+int
+frag_extend(int pnum, int slot, int nslots, int new_nslots)
+{
+    if(slot + new_nslots > FRAG_SLOTS) {
+        return -1;
+    }
+
+    frag_header* hdr = pages_get_page(pnum);
+    int more = slot_mask(slot + nslots, new_nslots - nslots);
+    if(hdr->used & more) {
+        return -1;
+    }
+
+    hdr->used |= more;
+    return 0;
+}
+
+// releases a slot run, freeing the page once nothing is left in it
+void
+frag_free(int pnum, int slot, int nslots)
+{
+    superblock* sb = get_superblock();
+    frag_header* hdr = pages_get_page(pnum);
+    memset(frag_get(pnum, slot), 0, nslots * FRAG_SLOT_SIZE);
+    hdr->used &= ~slot_mask(slot, nslots);
+
+    if(hdr->used == slot_mask(0, 1)) {
+        if(sb->frag_page == pnum) {
+            sb->frag_page = 0;
+        }
+        free_page(pnum);
+    }
+    else if(sb->frag_page == 0) {
+        // keep filling this page rather than starting a new one
+        sb->frag_page = pnum;
+    }
+}
+
+// gets a pointer to a slot
+void*
+frag_get(int pnum, int slot)
+{
+    char* page = pages_get_page(pnum);
+    return page + (slot * FRAG_SLOT_SIZE);
+}
@@ -0,0 +1,21 @@
+#ifndef FRAG_H
+#define FRAG_H
+
+// fragment pages hold the last partial page of many small files,
+// each page is split into fixed size slots with slot 0 used as a
+// header recording which slots are taken
+#define FRAG_SLOT_SIZE 256
+#define FRAG_SLOTS (4096 / FRAG_SLOT_SIZE)
+#define FRAG_MAX ((FRAG_SLOTS - 1) * FRAG_SLOT_SIZE)
+
+typedef struct frag_header {
+    int used; // bitmap of used slots, bit 0 is this header
+} frag_header;
+
+int frag_slots(int bytes);
+int frag_alloc(int nslots, int* pnum);
+int frag_extend(int pnum, int slot, int nslots, int new_nslots);
+void frag_free(int pnum, int slot, int nslots);
+void* frag_get(int pnum, int slot);
+
+#endif
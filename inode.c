@@ -2,22 +2,39 @@
 
 #include <stdio.h>
 #include <stdint.h>
+#include <stdlib.h>
 #include <sys/stat.h>
 #include <time.h>
 #include <errno.h>
+#include <string.h>
 #include "inode.h"
 #include "pages.h"
 #include "util.h"
 #include "bitmap.h"
 #include "sizes.h"
+#include "frag.h"
+#include "dedup.h"
+#include "compress.h"
 
 // prints the contents of an inode
 void 
 print_inode(inode* node)
 {
-    printf("refs: %d\nmode: 0x%X\nsize: %d\nptrs: %d, %d\niptr: %d\n",
-            node->refs, node->mode, node->size, node->ptrs[0],
-            node->ptrs[1], node->iptr);
+    printf("refs: %d\nmode: 0x%X\nsize: %d\nflags: 0x%X\n",
+            node->refs, node->mode, node->size, node->flags);
+    if(node->flags & INODE_INLINE) {
+        printf("inline: %d bytes\n", node->size);
+        return;
+    }
+    if(compress_active(node)) {
+        printf("cmap: %d\n", node->cmap);
+        return;
+    }
+    printf("ptrs: %d, %d\niptr: %d\n", node->ptrs[0], node->ptrs[1], node->iptr);
+    if(node->flags & INODE_TAIL) {
+        printf("tail: page %d, slots %d-%d\n", node->tail_page,
+                node->tail_slot, node->tail_slot + node->tail_slots - 1);
+    }
     if(node->iptr) {
         int* iptrs = pages_get_page(node->iptr);
         for(int ii = 0; ii < (page_size / sizeof(int)); ++ii) {
@@ -31,30 +48,144 @@ inode*
 get_inode(int num)
 {
     // ensure this is a valid inode index
-    if(num >= num_inodes) {
+    if(num < 0 || num >= num_inodes) {
+        return 0;
+    }
+
+    // the chunk index says which page its chunk is in, if it has one
+    int pnum = get_inode_chunks()[num / inodes_per_chunk];
+    if(pnum == 0) {
         return 0;
     }
+    inode* first_inode = (inode*)pages_get_page(pnum);
+
+    return (first_inode + (num % inodes_per_chunk));
+}
+
+// gives the chunk an inode is in a page, if it doesn't have one yet
+static
+int
+alloc_inode_chunk(int chunk)
+{
+    int* chunks = get_inode_chunks();
+    if(chunks[chunk]) {
+        return 0;
+    }
+
+    // at the start of the chunk's group, ahead of the pages its inodes
+    // are going to use
+    int group = chunk * inodes_per_chunk / inodes_per_group;
+    int pnum = alloc_page_near(group * pages_per_group);
+    if(pnum < 0) {
+        return pnum;
+    }
+    memset(pages_get_page(pnum), 0, page_size);
+    chunks[chunk] = pnum;
+    get_superblock()->inode_chunks += 1;
+    printf("+ alloc_inode_chunk(%d) -> %d\n", chunk, pnum);
+    return 0;
+}
+
+// gives back the page of a chunk none of whose inodes are in use
+static
+void
+free_inode_chunk(int chunk)
+{
+    char* bm = get_inode_bitmap();
+    int first = chunk * inodes_per_chunk;
+    for(int ii = first; ii < first + inodes_per_chunk; ++ii) {
+        if(bitmap_get(bm, ii)) {
+            return;
+        }
+    }
 
-    // get the page of the first inode
-    inode* first_inode = (inode*)pages_get_page((int)inode_start_page);
+    int* chunks = get_inode_chunks();
+    printf("+ free_inode_chunk(%d) -> %d\n", chunk, chunks[chunk]);
+    free_page(chunks[chunk]);
+    chunks[chunk] = 0;
+    get_superblock()->inode_chunks -= 1;
+}
 
-    return (first_inode + num);
+// picks the allocation group for a new inode in directory parent (-1
+// for none). files stay in their directory's group. directories right
+// under the root are spread out over the groups with the most room and
+// fewest directories (Orlov style), deeper ones stay with their parent
+// while its group has a fair share of free pages
+static
+int
+inode_group(int parent, int mode)
+{
+    superblock* sb = get_superblock();
+    alloc_group* groups = get_groups();
+    int home = parent < 0 ? 0 : parent / inodes_per_group;
+    int avg_pages = sb->free_pages / num_groups;
+    int avg_inodes = sb->free_inodes / num_groups;
+
+    if(S_ISDIR(mode) && parent >= 0) {
+        if(parent != root_inode && groups[home].free_inodes > 0 &&
+           groups[home].free_pages >= avg_pages / 4) {
+            return home;
+        }
+
+        int best = -1;
+        for(int ii = 0; ii < num_groups; ++ii) {
+            alloc_group* gg = &groups[ii];
+            if(gg->free_inodes == 0 || gg->free_inodes < avg_inodes ||
+               gg->free_pages < avg_pages) {
+                continue;
+            }
+            if(best < 0 || gg->dirs < groups[best].dirs ||
+               (gg->dirs == groups[best].dirs && gg->free_pages > groups[best].free_pages)) {
+                best = ii;
+            }
+        }
+        if(best >= 0) {
+            return best;
+        }
+    }
+
+    // the first group from home on with free inodes, and free pages
+    // too if there is one
+    for(int pass = 0; pass < 2; ++pass) {
+        for(int ii = 0; ii < num_groups; ++ii) {
+            int group = (home + ii) % num_groups;
+            if(groups[group].free_inodes > 0 && (pass || groups[group].free_pages > 0)) {
+                return group;
+            }
+        }
+    }
+    return -1;
 }
 
-// allocates an inode from the bitmap
+// allocates an inode of the given mode for a new entry in directory
+// parent, lowest free number in the group picked for it first so
+// chunks fill up before new ones are allocated
 int
-alloc_inode()
+alloc_inode(int parent, int mode)
 {
     char* bm = get_inode_bitmap();
+    int group = inode_group(parent, mode);
+    if(group < 0) {
+        return -ENOSPC;
+    }
 
     // finding an open inode
-    for(long ii = 0; ii < num_inodes; ++ii) {
+    int first = group * inodes_per_group;
+    for(long ii = first; ii < first + inodes_per_group; ++ii) {
         if(bitmap_get(bm, ii) == 0) {
+            if(alloc_inode_chunk(ii / inodes_per_chunk)) {
+                break;
+            }
+
             // found free inode, mark it as allocated
             bitmap_put(bm, ii, 1);
-            printf("+ alloc_inode(%li)\n", ii);
+            get_superblock()->free_inodes -= 1;
+            get_groups()[group].free_inodes -= 1;
+            get_groups()[group].dirs += S_ISDIR(mode) != 0;
+            printf("+ alloc_inode(%li) in group %d\n", ii, group);
             inode* node = get_inode(ii);
             memset(node, 0, sizeof(inode));
+            node->mode = mode;
 
             // set current modification time
             struct timespec ts;
@@ -69,41 +200,175 @@ alloc_inode()
     return -ENOSPC;
 }
 
-// frees an inode from the bitmap
+// handles open for writing on each inode, a file's reservation window
+// is only given up once the last of them is closed
+static int* open_writers = 0;
+
+// files at least this big are freed by the reclaimer instead of by
+// whoever dropped them. it cuts them down a cluster at a time, so no
+// partial page or cluster ever has to be stored again
+static const int orphan_min_size = 16 * 4096;
+static const int reclaim_size = CLUSTER_SIZE;
+
+// gives back inode inum once it holds no pages
+static
+void
+release_inode(int inum)
+{
+    inode* node = get_inode(inum);
+    printf("+ free_inode(%d)\n", inum);
+    alloc_group* group = &get_groups()[inum / inodes_per_group];
+    group->dirs -= S_ISDIR(node->mode) != 0;
+    group->free_inodes += 1;
+    bitmap_put(get_inode_bitmap(), inum, 0);
+    get_superblock()->free_inodes += 1;
+    pages_release_window(inum);
+    if(open_writers) {
+        // a handle still open on the file mustn't count for the next one
+        open_writers[inum] = 0;
+    }
+    free_inode_chunk(inum / inodes_per_chunk);
+}
+
+// whether freeing the pages of node is left to the reclaimer
+static
+int
+inode_deferred(inode* node)
+{
+    return S_ISREG(node->mode) && !(node->flags & INODE_INLINE) &&
+           node->size >= orphan_min_size;
+}
+
+// a free slot in the orphan list, -ENOSPC if it's full
+static
+int
+orphan_slot()
+{
+    int* orphans = get_orphans();
+    for(int ii = 0; ii < max_orphans; ++ii) {
+        if(orphans[ii] == 0) {
+            return ii;
+        }
+    }
+    return -ENOSPC;
+}
+
+// drops a reference to inode inum, freeing it with the last one
 int
-free_inode(inode* node)
+free_inode(int inum)
 {
+    // the root inode is never freed
+    inode* node = get_inode(inum);
+    if(node == 0 || inum == root_inode) {
+        return -ENOENT;
+    }
+
     // decrement refs counter
     node->refs -= 1;
     if(node->refs > 0) {
         return 0;
     }
 
+    // a large file keeps its inode, pages and all, on the orphan list
+    // until the reclaimer gets to it
+    int slot = inode_deferred(node) ? orphan_slot() : -ENOSPC;
+    if(slot >= 0) {
+        printf("+ free_inode(%d) left to the reclaimer\n", inum);
+        get_orphans()[slot] = inum;
+        pages_release_window(inum);
+        return 0;
+    }
+
     shrink_inode(node, node->size);
+    release_inode(inum);
+    return 0;
+}
 
-    // getting integers to do some arithmetic with
-    inode* start = get_inode(0);
+// a handle that can write inode inum has been opened
+void
+inode_open_writer(int inum)
+{
+    if(open_writers == 0) {
+        open_writers = calloc(num_inodes, sizeof(int));
+    }
+    open_writers[inum] += 1;
+}
 
-    // index of an inode is the difference between the start
-    // and node inode_ptr
-    int inode_index;
-    if(node > start) { // inode needs to be located after first inode
-       inode_index = (node - start);
+// a handle that could write inode inum has been closed. once none are
+// left, the pages reserved for the file to grow into can go to other
+// files
+void
+inode_close_writer(int inum)
+{
+    if(open_writers && open_writers[inum] > 0) {
+        open_writers[inum] -= 1;
     }
-    else {
-        return -ENOENT;
+    if(open_writers == 0 || open_writers[inum] == 0) {
+        pages_release_window(inum);
     }
+}
 
-    if(inode_index < 0 || inode_index >= num_inodes) {
-        return -ENOENT;
+// empties the file inum by handing its pages to a new inode on the
+// orphan list. returns 0 if it did, otherwise the pages are still the
+// file's to free
+int
+inode_detach(int inum)
+{
+    inode* node = get_inode(inum);
+    int slot = orphan_slot();
+    if(node == 0 || !inode_deferred(node) || slot < 0) {
+        return -ENOSPC;
     }
 
-    // can safely free the inode
-    printf("+ free_inode(%d)\n", inode_index);
-    bitmap_put(get_inode_bitmap(), inode_index, 0);
+    int onum = alloc_inode(inum, node->mode);
+    if(onum < 0) {
+        return onum;
+    }
+    printf("+ inode_detach(%d) -> %d\n", inum, onum);
+    inode* orphan = get_inode(onum);
+    memcpy(orphan, node, sizeof(inode));
+    orphan->refs = 0;
+    get_orphans()[slot] = onum;
+
+    node->size = 0;
+    node->flags &= ~INODE_TAIL;
+    memset(node->data, 0, sizeof(node->data));
+    pages_release_window(inum);
     return 0;
 }
 
+// frees up to count pages of the files on the orphan list, a whole
+// file's once it has none left. returns how many are still waiting
+int
+inode_reclaim(int count)
+{
+    int* orphans = get_orphans();
+    int waiting = 0;
+    for(int ii = 0; ii < max_orphans; ++ii) {
+        if(orphans[ii] == 0) {
+            continue;
+        }
+
+        // from the end, so the file stays whole until it's gone
+        inode* node = get_inode(orphans[ii]);
+        while(count > 0 && node->size > 0) {
+            int keep = (node->size - 1) / reclaim_size * reclaim_size;
+            if(shrink_inode(node, node->size - keep)) {
+                break;
+            }
+            count -= reclaim_size / page_size;
+        }
+
+        if(node->size > 0) {
+            waiting += 1;
+            continue;
+        }
+        release_inode(orphans[ii]);
+        orphans[ii] = 0;
+    }
+    return waiting;
+}
+
 // free's an array of page ptrs
 static
 void
@@ -117,27 +382,80 @@ free_all_pages(int* arr, int size)
 }
 
 
-// grows an inode, increasing the size and allocating
-// additional data pages if needed
+// only regular files and symlinks keep their contents inline or
+// packed, directories are always addressed a page at a time
+static
 int
-grow_inode(inode* node, int size)
+inode_can_inline(inode* node)
 {
-    int old_pages_used = bytes_to_pages(node->size);
-    int new_size = node->size + size;
-    int new_pages_used = bytes_to_pages(new_size);
+    return S_ISREG(node->mode) || S_ISLNK(node->mode);
+}
+
+// number of data pages mapped by the block pointers, a packed tail
+// doesn't count since it lives in a shared fragment page
+int
+inode_num_pages(inode* node)
+{
+    if((node->flags & INODE_INLINE) || compress_active(node)) {
+        return 0;
+    }
+    if(node->flags & INODE_TAIL) {
+        return node->size / page_size;
+    }
+    return bytes_to_pages(node->size);
+}
+
+// checks whether a file of size bytes, that currently has have
+// pages mapped, should keep its last partial page in a fragment
+static
+int
+inode_should_pack(inode* node, int size, int have)
+{
+    int tail = size % page_size;
+    return inode_can_inline(node) && 
+           tail > 0 && tail <= FRAG_MAX && 
+           have <= (size / page_size);
+}
+
+// allocates count pages for node, number inum, from goal on. a
+// file's come out of its reservation window so appends stay
+// contiguous
+static
+int
+inode_alloc_pages(inode* node, int inum, int goal, int* pages, int count)
+{
+    int owner = S_ISREG(node->mode) ? inum : -1;
+    return alloc_pages_for(owner, goal, pages, count);
+}
+
+static
+int
+inode_alloc_page(inode* node, int inum, int goal)
+{
+    int pnum;
+    int rv = inode_alloc_pages(node, inum, goal, &pnum, 1);
+    return rv ? rv : pnum;
+}
+
+// appends count already allocated pages to an inode's block
+// pointers, have being the number currently mapped. slot ii of the
+// file is ptrs[ii] for the first two and iptrs[ii - 2] after that, so
+// where the new pages go follows from have without searching
+static
+int
+inode_map_pages(inode* node, int inum, int have, int* pages, int count)
+{
+    int want = have + count;
 
     // check that all of required pages even fit into an inode
-    if(new_pages_used > ( (sizeof(node->ptrs) + page_size) / sizeof(int) )) {
+    if(want > ( (sizeof(node->ptrs) + page_size) / sizeof(int) )) {
         return -EFBIG;
     }
 
-    // calculate the number of pages to be added 
-    int add_pages = new_pages_used - old_pages_used;
-
     // if this is going to require indirect pointers 
     // allocate them now
-    if(old_pages_used < 3 && new_pages_used >= 3) {
-        int iptr_page = alloc_page();
+    if(have < 3 && want >= 3) {
+        int iptr_page = inode_alloc_page(node, inum, pages[0]);
         if(iptr_page < 0) {
             return -ENOSPC;
         }
@@ -145,62 +463,222 @@ grow_inode(inode* node, int size)
         node->iptr = iptr_page;
     }
 
-    // if this inode has indirect pointers get them now
-    int* iptrs = 0;
-    int iptr_ind = 0;
-    if(node->iptr) {
-        iptrs = (int*)pages_get_page(node->iptr);
-        // get the first available iptr
-        for(int ii = 0; ii < (page_size / sizeof(int)); ++ii) {
-            if(iptrs[ii] == 0) {
-                iptr_ind = ii;
-                break;
-            }
-        } 
+    int* iptrs = node->iptr ? pages_get_page(node->iptr) : 0;
+    for(int ii = 0; ii < count; ++ii) {
+        int slot = have + ii;
+        if(slot < 2) {
+            node->ptrs[slot] = pages[ii];
+        }
+        else {
+            iptrs[slot - 2] = pages[ii];
+        }
+    }
+
+    return 0;
+}
+
+// where to look for a free page for page index of node first: right
+// after the page before it, or else next to the inode itself, which
+// is in the inode's allocation group
+static
+int
+inode_page_goal(inode* node, int index)
+{
+    int prev = index > 0 ? inode_get_pnum(node, index - 1) : 0;
+    if(prev > 0) {
+        return prev + 1;
+    }
+    return pages_find(node);
+}
+
+// maps additional zeroed data pages onto an inode until it has
+// want pages, have being the number currently mapped
+static
+int
+inode_add_pages(inode* node, int inum, int have, int want)
+{
+    // check that all of required pages even fit into an inode
+    if(want > ( (sizeof(node->ptrs) + page_size) / sizeof(int) )) {
+        return -EFBIG;
+    }
+
+    // calculate the number of pages to be added 
+    int add_pages = want - have;
+    if(add_pages <= 0) {
+        return 0;
     }
 
     // allocate all the pages needed in one go
     int new_pages[add_pages];
+    int rv = inode_alloc_pages(node, inum, inode_page_goal(node, have), new_pages, add_pages);
+    if(rv) {
+        return rv;
+    }
     for(int ii = 0; ii < add_pages; ++ii) {
-        int new_page = alloc_page();
-        if(new_page < 0) {
-            free_all_pages(new_pages, ii);
-            return -ENOSPC;
+        memset(pages_get_page(new_pages[ii]), 0, page_size);
+    }
+
+    rv = inode_map_pages(node, inum, have, new_pages, add_pages);
+    if(rv) {
+        free_all_pages(new_pages, add_pages);
+    }
+    return rv;
+}
+
+// unmaps and frees data pages from the end of an inode until it
+// has want pages, have being the number currently mapped
+static
+int
+inode_drop_pages(inode* node, int have, int want)
+{
+    int* iptrs = node->iptr ? pages_get_page(node->iptr) : 0;
+
+    // pages are freed in the opposite order they are added, the
+    // indirect pointer page goes once nothing past ptrs[] is left
+    for(int slot = have - 1; slot >= want; --slot) {
+        int* ptr = slot < 2 ? &node->ptrs[slot] : (iptrs ? &iptrs[slot - 2] : 0);
+        if(ptr == 0) {
+            // probably shouldn't ever get here
+            return -EIO;
         }
-        new_pages[ii] = new_page;
-        memset(pages_get_page(new_page), 0, page_size);
-    }
-   
-    // to grow we need to allocate more data blocks, these are
-    // filled in in the following order
-    // 1. ptrs[0]
-    // 2. ptrs[1]
-    // 3. iptrs[0] -> iptrs[NN-1] 
-    for(int ii = 0; ii < add_pages; ++ii) {
-        int new_page = new_pages[ii];
-        if(new_page < 0) {
-            // check page was allocated
-            return -ENOSPC;
+        if(*ptr) {
+            free_page(*ptr);
+            *ptr = 0;
         }
-        if(node->ptrs[0] == 0) {
-            node->ptrs[0] = new_page;
+    }
+    if(node->iptr && want < 3) {
+        free_page(node->iptr);
+        node->iptr = 0;
+    }
+
+    return 0;
+}
+
+// releases the fragment slots holding an inode's packed tail
+static
+void
+inode_unpack_tail(inode* node)
+{
+    frag_free(node->tail_page, node->tail_slot, node->tail_slots);
+    node->tail_page = 0;
+    node->tail_slot = 0;
+    node->tail_slots = 0;
+    node->flags &= ~INODE_TAIL;
+}
+
+// grows a packed tail that stays on the same page index, in place
+// if the fragment page has room after it. returns 0 on success
+static
+int
+inode_grow_tail(inode* node, int new_size)
+{
+    if(new_size / page_size != node->size / page_size) {
+        return -1;
+    }
+
+    int need = frag_slots(new_size % page_size);
+    if(need > node->tail_slots) {
+        if(frag_extend(node->tail_page, node->tail_slot,
+                       node->tail_slots, need)) {
+            return -1;
         }
-        else if(node->ptrs[1] == 0) {
-            node->ptrs[1] = new_page;
+        char* slots = frag_get(node->tail_page, node->tail_slot);
+        memset(slots + node->tail_slots * FRAG_SLOT_SIZE, 0,
+               (need - node->tail_slots) * FRAG_SLOT_SIZE);
+        node->tail_slots = need;
+    }
+
+    node->size = new_size;
+    return 0;
+}
+
+// grows an inode, number inum, increasing the size and allocating
+// additional data pages if needed
+int
+grow_inode(inode* node, int inum, int size)
+{
+    int new_size = node->size + size;
+
+    // small enough to stay inside the inode, an empty inode has no
+    // block pointers in use so it can be switched over for free
+    int is_inline = node->flags & INODE_INLINE;
+    if((is_inline || node->size == 0) && 
+       inode_can_inline(node) && 
+       new_size <= INODE_INLINE_SIZE) {
+        if(!is_inline) {
+            memset(node->data, 0, INODE_INLINE_SIZE);
+            node->flags |= INODE_INLINE;
         }
-        else if(iptrs && 
-                (iptr_ind < (page_size/sizeof(int)) ) &&
-                (iptrs[iptr_ind] == 0)) {
-            iptrs[iptr_ind++] = new_page;
+        memset(node->data + node->size, 0, size);
+        node->size = new_size;
+        return 0;
+    }
+
+    // compressed files have a layout of their own
+    if(S_ISREG(node->mode) && (node->flags & INODE_COMPRESS)) {
+        return compress_grow(node, new_size);
+    }
+
+    // appending inside of a packed tail is the common case
+    if((node->flags & INODE_TAIL) && inode_grow_tail(node, new_size) == 0) {
+        return 0;
+    }
+
+    // anything not mapped by a data page (inline contents or a packed
+    // tail) is copied out, it is moved to wherever it belongs once
+    // the new pages are in place
+    int have = inode_num_pages(node);
+    int loose = node->size - (have * page_size);
+    char saved[page_size];
+    if(is_inline) {
+        memcpy(saved, node->data, loose);
+        // block pointers share space with the inline data
+        memset(node->data, 0, INODE_INLINE_SIZE);
+        node->flags &= ~INODE_INLINE;
+    }
+    else if(node->flags & INODE_TAIL) {
+        memcpy(saved, frag_get(node->tail_page, node->tail_slot), loose);
+    }
+
+    // work out the new layout, reserving a new tail before mapping any
+    // pages so a failure leaves the inode untouched
+    int pack = inode_should_pack(node, new_size, have);
+    int want = pack ? (new_size / page_size) : bytes_to_pages(new_size);
+    int tail_page = 0;
+    int tail_slots = frag_slots(new_size % page_size);
+    int tail_slot = pack ? frag_alloc(tail_slots, &tail_page) : 0;
+    int rv = (tail_slot < 0) ? tail_slot : inode_add_pages(node, inum, have, want);
+    if(rv) {
+        if(pack && tail_slot >= 0) {
+            frag_free(tail_page, tail_slot, tail_slots);
         }
-        else {
-            // this shouldn't happen
-            return -EFBIG;
+        if(is_inline) {
+            // put everything back the way it was
+            memcpy(node->data, saved, loose);
+            node->flags |= INODE_INLINE;
         }
+        return rv;
+    }
+
+    // release the old tail, whatever was in it is saved
+    if(node->flags & INODE_TAIL) {
+        inode_unpack_tail(node);
+    }
+
+    if(pack) {
+        memset(frag_get(tail_page, tail_slot), 0, tail_slots * FRAG_SLOT_SIZE);
+        node->tail_page = tail_page;
+        node->tail_slot = tail_slot;
+        node->tail_slots = tail_slots;
+        node->flags |= INODE_TAIL;
     }
 
-    // successfully update size_field
-    node->size += size;
+    // the loose bytes either land in the first newly mapped page or
+    // stay at the start of the new tail
+    node->size = new_size;
+    if(loose > 0) {
+        memcpy(inode_get_page(node, have), saved, loose);
+    }
     return 0;
 }
 
@@ -212,60 +690,87 @@ shrink_inode(inode* node, int size)
         return -EINVAL;
     }
 
-    // determine how many pages need to be freed
-    int old_pages_used = bytes_to_pages(node->size);
     int new_size = node->size - size;
-    int new_pages_used = bytes_to_pages(new_size);
-    
-    int free_pages = old_pages_used - new_pages_used;
-    
-    // get iptrs if needed
-    int* iptrs = 0;
-    int iptrs_ind = 0;
-    if(node->iptr) {
-        iptrs = pages_get_page(node->iptr);
-        // get the last used iptr
-        for(iptrs_ind = 0; iptrs_ind < (page_size / sizeof(int)); ++iptrs_ind) {
-            if(iptrs[iptrs_ind] == 0) {
-                iptrs_ind -= 1;
-                break;
-            }
+
+    // inline contents just need to be cleared
+    if(node->flags & INODE_INLINE) {
+        node->size = new_size;
+        memset(node->data + new_size, 0, size);
+        if(node->size == 0) {
+            node->flags &= ~INODE_INLINE;
         }
+        return 0;
     }
 
-    // pages are freed in the opposite order they are added
-    // 1. iptrs
-    // 2. ptrs[1]
-    // 3. ptrs[0]
-    for(int ii = 0; ii < free_pages; ++ii) {
-        if(iptrs && 
-           iptrs_ind < (page_size/sizeof(int)) &&
-           iptrs[iptrs_ind]) {
-            int temp = iptrs[iptrs_ind];
-            iptrs[iptrs_ind] = 0;
-            free_page(temp);
-            if(iptrs_ind == 0) {
-                free_page(node->iptr);
-                node->iptr = 0;
+    if(compress_active(node)) {
+        return compress_shrink(node, new_size);
+    }
+
+    int have = inode_num_pages(node);
+    if(node->flags & INODE_TAIL) {
+        // shrinking within the tail, give back unneeded slots
+        if(new_size / page_size == have) {
+            int tail = new_size % page_size;
+            int need = frag_slots(tail);
+            char* slots = frag_get(node->tail_page, node->tail_slot);
+            memset(slots + tail, 0, (node->size % page_size) - tail);
+            if(need == 0) {
+                inode_unpack_tail(node);
             }
-            iptrs_ind -= 1;
-        }
-        else if(node->ptrs[1]) {
-            free_page(node->ptrs[1]);
-            node->ptrs[1] = 0;
-        }
-        else if(node->ptrs[0]) {
-            free_page(node->ptrs[0]);
-            node->ptrs[0] = 0;
+            else if(need < node->tail_slots) {
+                frag_free(node->tail_page, node->tail_slot + need,
+                          node->tail_slots - need);
+                node->tail_slots = need;
+            }
+            node->size = new_size;
+            return 0;
         }
-        else {
-            // probably shouldn't ever get here
-            return -EIO;
+
+        // the whole tail is being cut off
+        inode_unpack_tail(node);
+        node->size = have * page_size;
+    }
+
+    // if the new last page is partial try packing it into a tail
+    int pack = inode_should_pack(node, new_size, 0);
+    int tail_page = 0;
+    int tail_slots = frag_slots(new_size % page_size);
+    int tail_slot = pack ? frag_alloc(tail_slots, &tail_page) : 0;
+    if(tail_slot < 0) {
+        pack = 0;
+    }
+
+    int last = new_size / page_size;
+    int tail = new_size % page_size;
+    if(pack) {
+        char* slots = frag_get(tail_page, tail_slot);
+        memset(slots, 0, tail_slots * FRAG_SLOT_SIZE);
+        memcpy(slots, inode_get_page(node, last), tail);
+    }
+    else if(tail > 0) {
+        // clear out what is past the end so it reads back as zeros
+        // if the file is grown again
+        char* page = inode_get_page_writable(node, last);
+        if(page == 0) {
+            return -ENOSPC;
         }
+        memset(page + tail, 0, page_size - tail);
+    }
+
+    int rv = inode_drop_pages(node, have, pack ? last : bytes_to_pages(new_size));
+    if(rv) {
+        return rv;
+    }
+
+    if(pack) {
+        node->tail_page = tail_page;
+        node->tail_slot = tail_slot;
+        node->tail_slots = tail_slots;
+        node->flags |= INODE_TAIL;
     }
 
     // successfully update size and return
-    node->size -= size;
+    node->size = new_size;
     return 0;
 }
 
@@ -278,6 +783,19 @@ inode_get_page(inode* node, int index)
         return 0;
     }
 
+    if(node->flags & INODE_INLINE) {
+        return (index == 0) ? node->data : 0;
+    }
+
+    // compressed clusters can't be handed out a page at a time
+    if(compress_active(node)) {
+        return 0;
+    }
+
+    if((node->flags & INODE_TAIL) && index == (node->size / page_size)) {
+        return frag_get(node->tail_page, node->tail_slot);
+    }
+
     if(index < 2) {
         return pages_get_page(node->ptrs[index]);
     }
@@ -288,3 +806,132 @@ inode_get_page(inode* node, int index)
 
     return 0;
 }
+
+// gets the page number backing page index fpn of an inode's block
+// pointers, 0 if there isn't one
+int
+inode_get_pnum(inode* node, int fpn)
+{
+    if((node->flags & INODE_INLINE) || compress_active(node)) {
+        return 0;
+    }
+
+    if(fpn < 2) {
+        return node->ptrs[fpn];
+    }
+    else if(node->iptr) {
+        int* iptrs = pages_get_page(node->iptr);
+        return iptrs[fpn - 2];
+    }
+
+    return 0;
+}
+
+// points page index fpn of an inode's block pointers at pnum
+void
+inode_set_pnum(inode* node, int fpn, int pnum)
+{
+    if(fpn < 2) {
+        node->ptrs[fpn] = pnum;
+    }
+    else {
+        int* iptrs = pages_get_page(node->iptr);
+        iptrs[fpn - 2] = pnum;
+    }
+}
+
+// returns the page at the specified index in the inode, ready to be
+// written to. a page shared with another file is copied first
+void*
+inode_get_page_writable(inode* node, int index)
+{
+    int pnum = inode_get_pnum(node, index);
+    if(pnum == 0 || index >= inode_num_pages(node)) {
+        return inode_get_page(node, index);
+    }
+    if(page_refs(pnum) == 1) {
+        // about to change, it no longer matches its fingerprint
+        dedup_forget(pnum);
+        return inode_get_page(node, index);
+    }
+
+    int copy = alloc_page_near(inode_page_goal(node, index));
+    if(copy < 0) {
+        return 0;
+    }
+    printf("+ inode_get_page_writable(%d) copy %d -> %d\n", index, pnum, copy);
+    memcpy(pages_get_page(copy), pages_get_page(pnum), page_size);
+    inode_set_pnum(node, index, copy);
+    free_page(pnum);
+    return pages_get_page(copy);
+}
+
+// makes page index dst_index of dst share the full data page at
+// src_index of src, either replacing a full page dst already has or
+// appending to a dst that ends on a page boundary. returns nonzero
+// if the page has to be copied instead
+int
+inode_clone_page(inode* dst, int dst_inum, int dst_index, inode* src, int src_index)
+{
+    if(src_index >= (src->size / page_size) || 
+       (src->flags & INODE_INLINE) || (dst->flags & INODE_INLINE) ||
+       compress_active(src) || (dst->flags & INODE_COMPRESS)) {
+        return -1;
+    }
+
+    int have = inode_num_pages(dst);
+    int replace = dst_index < (dst->size / page_size);
+    int append = dst_index == have && dst->size == (have * page_size);
+    if(!replace && !append) {
+        return -1;
+    }
+
+    int pnum = inode_get_pnum(src, src_index);
+    if(pnum == 0 || page_ref(pnum)) {
+        return -1;
+    }
+
+    if(replace) {
+        int old = inode_get_pnum(dst, dst_index);
+        inode_set_pnum(dst, dst_index, pnum);
+        free_page(old);
+        return 0;
+    }
+
+    int rv = inode_map_pages(dst, dst_inum, have, &pnum, 1);
+    if(rv) {
+        free_page(pnum);
+        return rv;
+    }
+    dst->size += page_size;
+    return 0;
+}
+
+// calls fn for every page an inode refers to: its data pages, its
+// indirect pointer page (or cluster map) and the fragment page
+// holding its tail
+void
+inode_for_each_page(inode* node, inode_page_fn fn, void* arg)
+{
+    if(node->flags & INODE_INLINE) {
+        return;
+    }
+    if(compress_active(node)) {
+        compress_for_each_page(node, fn, arg);
+        return;
+    }
+
+    int npages = inode_num_pages(node);
+    for(int ii = 0; ii < npages; ++ii) {
+        int pnum = inode_get_pnum(node, ii);
+        if(pnum) {
+            fn(node, pnum, INODE_PAGE_DATA, ii, arg);
+        }
+    }
+    if(node->iptr) {
+        fn(node, node->iptr, INODE_PAGE_INDIRECT, -1, arg);
+    }
+    if(node->flags & INODE_TAIL) {
+        fn(node, node->tail_page, INODE_PAGE_TAIL, npages, arg);
+    }
+}
@@ -6,23 +6,60 @@
 #include <sys/stat.h>
 #include "pages.h"
 
+// size of an on-image inode record, everything past the fixed
+// header can hold the contents of a small file or symlink
+#define INODE_SIZE 256
+#define INODE_INLINE_SIZE (INODE_SIZE - 32)
+
+// inode flags
+#define INODE_INLINE 0x1 // contents are stored in data[], not pages
+#define INODE_TAIL 0x2 // last partial page is packed in a fragment page
+#define INODE_COMPRESS 0x4 // contents are in compressed clusters, on a
+                           // directory new files get the flag too
+
 typedef struct inode {
     int refs; // reference count
     int mode; // permission & type
     int size; // bytes
-    int ptrs[2]; // direct pointers
-    int iptr; // single indirect pointer
+    int flags; // INODE_* storage flags
     time_t mtime; // modification time seconds
     time_t atime; // access time seconds
+    union {
+        struct {
+            int ptrs[2]; // direct pointers
+            int iptr; // single indirect pointer
+            int tail_page; // fragment page holding the packed tail
+            short tail_slot; // first fragment slot of the tail
+            short tail_slots; // number of fragment slots used
+            int cmap; // cluster map page of a compressed file
+        };
+        char data[INODE_INLINE_SIZE]; // inline contents
+    };
 } inode;
 
+// kinds of pages passed to an inode_page_fn
+#define INODE_PAGE_DATA 0
+#define INODE_PAGE_INDIRECT 1
+#define INODE_PAGE_TAIL 2
+
+typedef void (*inode_page_fn)(inode* node, int pnum, int kind, int index, void* arg);
+
 void print_inode(inode* node);
 inode* get_inode(int inum);
-int alloc_inode();
-int free_inode(inode* node);
-int grow_inode(inode* node, int size);
+int alloc_inode(int parent, int mode);
+int free_inode(int inum);
+int inode_detach(int inum);
+void inode_open_writer(int inum);
+void inode_close_writer(int inum);
+int inode_reclaim(int count);
+int grow_inode(inode* node, int inum, int size);
 int shrink_inode(inode* node, int size);
 int inode_get_pnum(inode* node, int fpn);
 void* inode_get_page(inode* node, int index);
+void* inode_get_page_writable(inode* node, int index);
+int inode_clone_page(inode* dst, int dst_inum, int dst_index, inode* src, int src_index);
+int inode_num_pages(inode* node);
+void inode_set_pnum(inode* node, int fpn, int pnum);
+void inode_for_each_page(inode* node, inode_page_fn fn, void* arg);
 
 #endif
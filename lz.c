@@ -0,0 +1,207 @@
+#include <stdint.h>
+#include <string.h>
+
+#include "lz.h"
+
+#define LZ_HASH_BITS 12
+#define LZ_MIN_MATCH 4
+#define LZ_MAX_OFFSET 65535
+
+// the format requires the last 5 bytes to be literals, and no match
+// may start in the last 12
+#define LZ_LAST_LITERALS 5
+#define LZ_MATCH_LIMIT 12
+
+static
+uint32_t
+read32(const uint8_t* p)
+{
+    uint32_t v;
+    memcpy(&v, p, sizeof(v));
+    return v;
+}
+
+static
+int
+lz_hash(uint32_t seq)
+{
+    return (seq * 2654435761u) >> (32 - LZ_HASH_BITS);
+}
+
+// writes the extra bytes of a length that didn't fit in its 4 bits
+// of the token
+static
+uint8_t*
+put_length(uint8_t* op, int len)
+{
+    for(len -= 15; len >= 255; len -= 255) {
+        *op++ = 255;
+    }
+    *op++ = len;
+    return op;
+}
+
+// appends a sequence of literals followed by a match, a match length
+// of 0 marks the final sequence. returns 0 if it doesn't fit
+static
+uint8_t*
+put_sequence(uint8_t* op, uint8_t* oend, const uint8_t* lit, int nlit,
+             int offset, int mlen)
+{
+    int need = 1 + nlit + (nlit / 255) + 1;
+    if(mlen) {
+        need += 2 + ((mlen - LZ_MIN_MATCH) / 255) + 1;
+    }
+    if(need > oend - op) {
+        return 0;
+    }
+
+    uint8_t* token = op++;
+    *token = (nlit < 15 ? nlit : 15) << 4;
+    if(nlit >= 15) {
+        op = put_length(op, nlit);
+    }
+    memcpy(op, lit, nlit);
+    op += nlit;
+
+    if(mlen) {
+        *op++ = offset & 0xff;
+        *op++ = offset >> 8;
+        int ml = mlen - LZ_MIN_MATCH;
+        *token |= (ml < 15 ? ml : 15);
+        if(ml >= 15) {
+            op = put_length(op, ml);
+        }
+    }
+    return op;
+}
+
+// compresses len bytes of src into dst, returning the compressed
+// size or 0 if it would take more than cap bytes
+int
+lz_compress(const void* src, int len, void* dst, int cap)
+{
+    const uint8_t* in = src;
+    uint8_t* op = dst;
+    uint8_t* oend = op + cap;
+
+    // most recent position each hashed 4 byte sequence was seen at
+    int table[1 << LZ_HASH_BITS];
+    memset(table, 0xff, sizeof(table));
+
+    int anchor = 0;
+    int ip = 0;
+    int misses = 0;
+    while(ip < len - LZ_MATCH_LIMIT) {
+        uint32_t seq = read32(in + ip);
+        int hh = lz_hash(seq);
+        int ref = table[hh];
+        table[hh] = ip;
+
+        if(ref < 0 || ip - ref > LZ_MAX_OFFSET || read32(in + ref) != seq) {
+            // skip ahead faster through data that isn't compressing
+            ip += 1 + (misses++ >> 5);
+            continue;
+        }
+        misses = 0;
+
+        // grow the match backwards into the pending literals, then
+        // as far forward as it goes
+        while(ip > anchor && ref > 0 && in[ip - 1] == in[ref - 1]) {
+            ip -= 1;
+            ref -= 1;
+        }
+        int mlen = LZ_MIN_MATCH;
+        int mmax = len - LZ_LAST_LITERALS - ip;
+        while(mlen < mmax && in[ip + mlen] == in[ref + mlen]) {
+            mlen += 1;
+        }
+
+        op = put_sequence(op, oend, in + anchor, ip - anchor, ip - ref, mlen);
+        if(op == 0) {
+            return 0;
+        }
+        ip += mlen;
+        anchor = ip;
+    }
+
+    op = put_sequence(op, oend, in + anchor, len - anchor, 0, 0);
+    if(op == 0) {
+        return 0;
+    }
+    return op - (uint8_t*)dst;
+}
+
+// reads a length continued past the 4 bits in the token
+static
+int
+get_length(const uint8_t** ip, const uint8_t* iend, int len)
+{
+    int bb;
+    do {
+        if(*ip >= iend) {
+            return -1;
+        }
+        bb = *(*ip)++;
+        len += bb;
+    } while(bb == 255);
+    return len;
+}
+
+// decompresses len bytes of src into dst, returning the size of the
+// original data or -1 if src is corrupt or doesn't fit in cap bytes
+int
+lz_decompress(const void* src, int len, void* dst, int cap)
+{
+    const uint8_t* ip = src;
+    const uint8_t* iend = ip + len;
+    uint8_t* op = dst;
+    uint8_t* oend = op + cap;
+
+    while(ip < iend) {
+        int token = *ip++;
+
+        int nlit = token >> 4;
+        if(nlit == 15 && (nlit = get_length(&ip, iend, nlit)) < 0) {
+            return -1;
+        }
+        if(nlit > iend - ip || nlit > oend - op) {
+            return -1;
+        }
+        memcpy(op, ip, nlit);
+        ip += nlit;
+        op += nlit;
+
+        // the last sequence is only literals
+        if(ip == iend) {
+            break;
+        }
+
+        if(iend - ip < 2) {
+            return -1;
+        }
+        int offset = ip[0] | (ip[1] << 8);
+        ip += 2;
+        if(offset == 0 || offset > op - (uint8_t*)dst) {
+            return -1;
+        }
+
+        int mlen = token & 15;
+        if(mlen == 15 && (mlen = get_length(&ip, iend, mlen)) < 0) {
+            return -1;
+        }
+        mlen += LZ_MIN_MATCH;
+        if(mlen > oend - op) {
+            return -1;
+        }
+
+        // matches can overlap what they are copying, so go a byte
+        // at a time
+        for(int ii = 0; ii < mlen; ++ii) {
+            op[ii] = op[ii - offset];
+        }
+        op += mlen;
+    }
+
+    return op - (uint8_t*)dst;
+}
@@ -0,0 +1,11 @@
+#ifndef LZ_H
+#define LZ_H
+
+// small LZ77 compressor using the LZ4 block format: a token byte
+// holding the literal and match lengths, the literals, then a two
+// byte offset back into the output to copy the match from
+
+int lz_compress(const void* src, int len, void* dst, int cap);
+int lz_decompress(const void* src, int len, void* dst, int cap);
+
+#endif
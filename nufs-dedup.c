@@ -0,0 +1,66 @@
+// command line tool for deduplicating a mounted nufs filesystem and
+// reporting how much space sharing pages saves
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <sys/ioctl.h>
+
+#include "sizes.h"
+#include "util.h"
+#include "nufs_ioctl.h"
+
+static int
+usage()
+{
+    fprintf(stderr, "usage: nufs-dedup [-s] MOUNT\n"
+                    "  -s  only print statistics, don't dedup\n");
+    return 1;
+}
+
+int
+main(int argc, char* argv[])
+{
+    int stats_only = argc == 3 && streq(argv[1], "-s");
+    if(argc != 2 && !stats_only) {
+        return usage();
+    }
+
+    const char* mount = argv[argc - 1];
+    int fd = open(mount, O_RDONLY);
+    if(fd < 0) {
+        perror(mount);
+        return 1;
+    }
+
+    int freed = 0;
+    if(!stats_only && ioctl(fd, NUFS_IOC_DEDUP, &freed) < 0) {
+        perror("ioctl");
+        return 1;
+    }
+
+    struct nufs_stats st;
+    if(ioctl(fd, NUFS_IOC_STATS, &st) < 0) {
+        perror("ioctl");
+        return 1;
+    }
+    close(fd);
+
+    if(!stats_only) {
+        printf("freed:  %d pages\n", freed);
+    }
+    printf("total:  %lu pages\n", (unsigned long)st.pages_total);
+    printf("free:   %lu pages\n", (unsigned long)st.pages_free);
+    printf("shared: %lu pages (%lu KiB saved)\n", (unsigned long)st.pages_shared,
+           (unsigned long)st.pages_shared * page_size / 1024);
+    printf("merged: %lu pages by dedup\n", (unsigned long)st.dedup_merged);
+    printf("compressed: %lu pages stored in %lu\n", (unsigned long)st.compress_raw,
+           (unsigned long)st.compress_stored);
+    printf("checksum errors: %lu (%lu pages still bad)\n",
+           (unsigned long)st.csum_errors, (unsigned long)st.bad_pages);
+    printf("scrubbed: %lu pages, %lu full passes\n",
+           (unsigned long)st.scrub_pages, (unsigned long)st.scrub_passes);
+    return 0;
+}
@@ -0,0 +1,48 @@
+// command line tool for defragmenting files on a mounted nufs
+// filesystem, or everything at once given the mount point
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <sys/ioctl.h>
+
+#include "nufs_ioctl.h"
+
+static int
+usage()
+{
+    fprintf(stderr, "usage: nufs-defrag PATH...\n"
+                    "  a file is moved into one run of pages, the mount point\n"
+                    "  defragments every file and compacts free space\n");
+    return 1;
+}
+
+int
+main(int argc, char* argv[])
+{
+    if(argc < 2) {
+        return usage();
+    }
+
+    int rv = 0;
+    for(int ii = 1; ii < argc; ++ii) {
+        int fd = open(argv[ii], O_RDONLY);
+        if(fd < 0) {
+            perror(argv[ii]);
+            rv = 1;
+            continue;
+        }
+
+        int moved = 0;
+        if(ioctl(fd, NUFS_IOC_DEFRAG, &moved) < 0) {
+            perror(argv[ii]);
+            rv = 1;
+        }
+        else {
+            printf("%s: %d pages moved\n", argv[ii], moved);
+        }
+        close(fd);
+    }
+    return rv;
+}
@@ -0,0 +1,865 @@
+// command line tool for checking, and optionally repairing, an
+// unmounted nufs image
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <stdarg.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <sys/stat.h>
+
+#include "pages.h"
+#include "inode.h"
+#include "directory.h"
+#include "storage.h"
+#include "snapshot.h"
+#include "compress.h"
+#include "frag.h"
+#include "bitmap.h"
+#include "sizes.h"
+#include "util.h"
+
+/**
+ * The live filesystem and every snapshot are checked as separate
+ * views, each with its own superblock page and inode chunks. Inodes
+ * of all of them are scanned by a pool of threads, which count the
+ * references to every page and every inode as they go, then the
+ * totals are compared with the page bitmap, the page reference
+ * counts and the inode reference counts. Only the live view is ever
+ * repaired, snapshots are read-only
+ */
+
+// fsck(8) style exit codes
+#define FSCK_OK 0
+#define FSCK_FIXED 1
+#define FSCK_UNFIXED 4
+#define FSCK_FAILED 8
+
+#define MAX_VIEWS (SNAP_MAX + 1)
+
+typedef struct view {
+    int id; // 0 for the live filesystem, otherwise a snapshot id
+    int meta; // where its copy of page 0 is
+    char* ibm; // its inode bitmap
+    int* chunks; // its inode chunk index
+    int* orphans; // its orphan list
+} view;
+
+static view views[MAX_VIEWS];
+static int nviews = 0;
+
+static int repair = 0;
+static int nthreads = 1;
+
+// what the scan found, the counters are updated by several threads
+static int* page_uses; // references to each page from every view
+static char* frag_seen; // per view, fragment pages already counted
+static int* frag_masks; // per view, fragment slots used by tails
+static int* links; // per view, entries pointing at each inode
+static char* bad_inodes; // per view, inodes too broken to look inside
+static char* orphaned; // per view, inodes on the orphan list
+
+// keeps the threads' reports and fixes from interleaving
+static pthread_mutex_t fsck_lock = PTHREAD_MUTEX_INITIALIZER;
+static int problems = 0;
+static int fixed = 0;
+
+static int
+usage()
+{
+    fprintf(stderr, "usage: nufs-fsck [-r] [-j THREADS] IMAGE\n"
+                    "  -r  repair what can be repaired\n"
+                    "  -j  threads to scan with, defaults to one per cpu\n");
+    return FSCK_FAILED;
+}
+
+// only the live filesystem can be changed, and only with -r
+static int
+fixing(view* v)
+{
+    return repair && v->id == 0;
+}
+
+// prints a problem, noting whether it is being fixed
+static void
+report(int fix, const char* fmt, ...)
+{
+    va_list ap;
+    va_start(ap, fmt);
+    pthread_mutex_lock(&fsck_lock);
+    vfprintf(stdout, fmt, ap);
+    printf(fix ? " (fixed)\n" : "\n");
+    problems += 1;
+    fixed += fix;
+    pthread_mutex_unlock(&fsck_lock);
+    va_end(ap);
+}
+
+// a view's name for messages
+static const char*
+view_name(view* v, char* buf, int size)
+{
+    if(v->id == 0) {
+        return "";
+    }
+    snprintf(buf, size, "snapshot %d: ", v->id);
+    return buf;
+}
+
+// page numbers an inode is allowed to point at
+static int
+page_ok(int pnum)
+{
+    return pnum > 0 && pnum < num_pages;
+}
+
+static inode*
+view_inode(view* v, int inum)
+{
+    inode* first = pages_get_page(v->chunks[inum / inodes_per_chunk]);
+    return first + inum % inodes_per_chunk;
+}
+
+// runs fn over items 0 - count-1 on nthreads threads
+typedef void (*work_fn)(int item);
+
+typedef struct work {
+    work_fn fn;
+    int count;
+    int next;
+} work;
+
+static void*
+work_main(void* arg)
+{
+    work* job = arg;
+    for(;;) {
+        int item = __atomic_fetch_add(&job->next, 1, __ATOMIC_RELAXED);
+        if(item >= job->count) {
+            break;
+        }
+        job->fn(item);
+    }
+    return 0;
+}
+
+static void
+run_parallel(work_fn fn, int count)
+{
+    work job = { fn, count, 0 };
+    pthread_t threads[nthreads];
+    int started = 0;
+    for(; started < nthreads - 1; ++started) {
+        if(pthread_create(&threads[started], 0, work_main, &job)) {
+            break;
+        }
+    }
+    work_main(&job);
+    for(int ii = 0; ii < started; ++ii) {
+        pthread_join(threads[ii], 0);
+    }
+}
+
+// checks the fields an inode's pages are found through, so walking
+// its pages can't run off the image
+static int
+inode_sane(inode* node)
+{
+    if(!S_ISREG(node->mode) && !S_ISDIR(node->mode) && !S_ISLNK(node->mode)) {
+        return 0;
+    }
+    if(node->size < 0 || node->refs < 0) {
+        return 0;
+    }
+    if(node->flags & INODE_INLINE) {
+        return !S_ISDIR(node->mode) && node->size <= INODE_INLINE_SIZE;
+    }
+    if(compress_active(node)) {
+        return page_ok(node->cmap) && node->size <= COMPRESS_MAX_SIZE;
+    }
+
+    int npages = inode_num_pages(node);
+    if(npages > 2 + page_size / (int)sizeof(int)) {
+        return 0;
+    }
+    if(S_ISDIR(node->mode) && node->size % page_size != 0) {
+        return 0;
+    }
+    for(int ii = 0; ii < 2; ++ii) {
+        if(node->ptrs[ii] && !page_ok(node->ptrs[ii])) {
+            return 0;
+        }
+    }
+    if(npages > 2 && !page_ok(node->iptr)) {
+        return 0;
+    }
+    if(node->flags & INODE_TAIL) {
+        int tail = node->size % page_size;
+        return page_ok(node->tail_page) && node->tail_slot >= 1 &&
+               node->tail_slots >= 1 &&
+               node->tail_slot + node->tail_slots <= FRAG_SLOTS &&
+               tail <= node->tail_slots * FRAG_SLOT_SIZE;
+    }
+    return 1;
+}
+
+typedef struct page_walk {
+    view* v;
+    int vnum;
+    int inum;
+} page_walk;
+
+// counts one of the pages an inode uses
+static void
+count_page(inode* node, int pnum, int kind, int index, void* arg)
+{
+    page_walk* walk = arg;
+    char name[32];
+    if(!page_ok(pnum)) {
+        report(0, "%sinode %d page %d points at page %d",
+               view_name(walk->v, name, sizeof(name)), walk->inum, index, pnum);
+        return;
+    }
+    if(kind != INODE_PAGE_TAIL) {
+        __atomic_fetch_add(&page_uses[pnum], 1, __ATOMIC_RELAXED);
+        return;
+    }
+
+    // a fragment page is one reference however many tails it holds
+    int slot = walk->vnum * num_pages + pnum;
+    if(!__atomic_exchange_n(&frag_seen[slot], 1, __ATOMIC_RELAXED)) {
+        __atomic_fetch_add(&page_uses[pnum], 1, __ATOMIC_RELAXED);
+    }
+    int mask = ((1 << node->tail_slots) - 1) << node->tail_slot;
+    int old = __atomic_fetch_or(&frag_masks[slot], mask, __ATOMIC_RELAXED);
+    if(old & mask) {
+        report(0, "%sinode %d tail overlaps another in fragment page %d",
+               view_name(walk->v, name, sizeof(name)), walk->inum, pnum);
+    }
+}
+
+typedef void (*entry_fn)(view* v, int vnum, int dinum, dirent* ent);
+
+// walks the entries of a directory, reporting and with -r fixing
+// anything malformed when check is set, calling fn for every good one
+static void
+scan_dir(int vnum, int dinum, entry_fn fn, int check)
+{
+    view* v = &views[vnum];
+    inode* dd = view_inode(v, dinum);
+    int fix = fixing(v) && check;
+    char name[32];
+    const char* vn = view_name(v, name, sizeof(name));
+
+    int npages = dd->size / page_size;
+    for(int ii = 0; ii < npages; ++ii) {
+        int pnum = inode_get_pnum(dd, ii);
+        if(!page_ok(pnum)) {
+            if(check) {
+                report(0, "%sdirectory %d is missing page %d", vn, dinum, ii);
+            }
+            continue;
+        }
+
+        dirpage* pg = pages_get_page(pnum);
+        if(!dirpage_valid(pg)) {
+            if(check) {
+                report(fix, "%sdirectory %d page %d has a bad header", vn, dinum, ii);
+            }
+            if(!fix) {
+                continue;
+            }
+            pg->used = sizeof(dirpage);
+        }
+
+        int count = 0;
+        char* end = (char*)pg + pg->used;
+        dirent* ent = (dirent*)(pg + 1);
+        while((char*)ent < end) {
+            if(!dirent_valid(pg, ent)) {
+                // nothing past a broken entry can be trusted
+                if(check) {
+                    report(fix, "%sdirectory %d page %d has a corrupt entry at %d",
+                           vn, dinum, ii, (int)((char*)ent - (char*)pg));
+                }
+                if(fix) {
+                    pg->used = (char*)ent - (char*)pg;
+                }
+                break;
+            }
+
+            int inum = ent->inum;
+            if(inum <= root_inode || inum >= num_inodes ||
+               !bitmap_get(v->ibm, inum) || bad_inodes[vnum * num_inodes + inum]) {
+                if(check) {
+                    report(fix, "%sentry %s in directory %d points at unused inode %d",
+                           vn, ent->name, dinum, inum);
+                }
+                if(fix) {
+                    char* next = (char*)ent + ent->len;
+                    memmove(ent, next, end - next);
+                    pg->used -= next - (char*)ent;
+                    end = (char*)pg + pg->used;
+                    continue;
+                }
+                ent = (dirent*)((char*)ent + ent->len);
+                continue;
+            }
+
+            if(check && ent->hash != name_hash(ent->name)) {
+                report(fix, "%sentry %s in directory %d has the wrong hash",
+                       vn, ent->name, dinum);
+                if(fix) {
+                    ent->hash = name_hash(ent->name);
+                }
+            }
+
+            count += 1;
+            fn(v, vnum, dinum, ent);
+            ent = (dirent*)((char*)ent + ent->len);
+        }
+
+        if(check && pg->count != count) {
+            report(fix, "%sdirectory %d page %d counts %d entries, has %d",
+                   vn, dinum, ii, pg->count, count);
+            if(fix) {
+                pg->count = count;
+            }
+        }
+    }
+}
+
+static void
+count_link(view* v, int vnum, int dinum, dirent* ent)
+{
+    __atomic_fetch_add(&links[vnum * num_inodes + ent->inum], 1, __ATOMIC_RELAXED);
+}
+
+// first pass, run in parallel: finds every broken inode so the
+// entries pointing at them can be recognized later
+static void
+check_inode(int item)
+{
+    int vnum = item / num_inodes;
+    int inum = item % num_inodes;
+    view* v = &views[vnum];
+    if(!bitmap_get(v->ibm, inum) || bad_inodes[item]) {
+        return;
+    }
+
+    inode* node = view_inode(v, inum);
+    if(!inode_sane(node)) {
+        char name[32];
+        bad_inodes[item] = 1;
+        if(inum == root_inode) {
+            report(0, "%sthe root directory is corrupt", view_name(v, name, sizeof(name)));
+            return;
+        }
+        report(fixing(v), "%sinode %d is corrupt", view_name(v, name, sizeof(name)), inum);
+        if(fixing(v)) {
+            pthread_mutex_lock(&fsck_lock);
+            bitmap_put(v->ibm, inum, 0);
+            memset(node, 0, sizeof(inode));
+            pthread_mutex_unlock(&fsck_lock);
+        }
+    }
+}
+
+// second pass, also in parallel: counts the pages and links of
+// every good inode
+static void
+scan_inode(int item)
+{
+    int vnum = item / num_inodes;
+    int inum = item % num_inodes;
+    view* v = &views[vnum];
+    if(!bitmap_get(v->ibm, inum) || bad_inodes[item]) {
+        return;
+    }
+
+    inode* node = view_inode(v, inum);
+    page_walk walk = { v, vnum, inum };
+    inode_for_each_page(node, count_page, &walk);
+    if(S_ISDIR(node->mode)) {
+        scan_dir(vnum, inum, count_link, 1);
+    }
+}
+
+// every page in use should still match its checksum
+static void
+check_checksum(int pnum)
+{
+    if(!bitmap_get(get_pages_bitmap(), pnum)) {
+        return;
+    }
+    uint32_t* csums = (uint32_t*)((char*)pages_get_page(0) + page_csums_offset);
+    if(page_checksum(pages_get_page(pnum), pnum) != csums[pnum]) {
+        report(repair, "page %d doesn't match its checksum", pnum);
+    }
+}
+
+// follows directories down from the root, counting an inode once
+// however many times it is linked
+static char* reached;
+
+static void
+reach(view* v, int vnum, int dinum, dirent* ent)
+{
+    int slot = vnum * num_inodes + ent->inum;
+    if(reached[slot]) {
+        return;
+    }
+    reached[slot] = 1;
+    if(S_ISDIR(view_inode(v, ent->inum)->mode)) {
+        scan_dir(vnum, ent->inum, reach, 0);
+    }
+}
+
+// gives inodes nothing links to a name in /lost+found
+static int
+link_orphan(int inum)
+{
+    int lf;
+    inode* lf_node;
+    if(path_get_inode("/lost+found", &lf, &lf_node)) {
+        int rv = storage_mknod("/lost+found", 040700);
+        if(rv || path_get_inode("/lost+found", &lf, &lf_node)) {
+            return -1;
+        }
+    }
+
+    char name[16];
+    snprintf(name, sizeof(name), "#%d", inum);
+    return directory_put(lf_node, name, inum);
+}
+
+// every entry on the orphan list has to be an inode in use that no
+// entry points at, listed once, with no references left
+static void
+check_orphans(int vnum)
+{
+    view* v = &views[vnum];
+    int fix = fixing(v);
+    char name[32];
+    const char* vn = view_name(v, name, sizeof(name));
+
+    for(int ii = 0; ii < max_orphans; ++ii) {
+        int inum = v->orphans[ii];
+        if(inum == 0) {
+            continue;
+        }
+
+        int slot = vnum * num_inodes + inum;
+        if(inum < 0 || inum >= num_inodes || !bitmap_get(v->ibm, inum) ||
+           bad_inodes[slot] || links[slot] || orphaned[slot]) {
+            report(fix, "%sorphan list entry %d is inode %d, which isn't an orphan",
+                   vn, ii, inum);
+            if(fix) {
+                v->orphans[ii] = 0;
+            }
+            continue;
+        }
+
+        orphaned[slot] = 1;
+        inode* node = view_inode(v, inum);
+        if(node->refs != 0) {
+            report(fix, "%sorphan %d has %d references", vn, inum, node->refs);
+            if(fix) {
+                node->refs = 0;
+            }
+        }
+    }
+}
+
+// compares the inode reference counts with the entries found, and
+// looks for inodes that can't be reached from the root
+static void
+check_links()
+{
+    char name[32];
+    for(int vnum = 0; vnum < nviews; ++vnum) {
+        view* v = &views[vnum];
+        const char* vn = view_name(v, name, sizeof(name));
+        reached[vnum * num_inodes + root_inode] = 1;
+        if(!bad_inodes[vnum * num_inodes + root_inode]) {
+            scan_dir(vnum, root_inode, reach, 0);
+        }
+
+        for(int inum = 0; inum < num_inodes; ++inum) {
+            int slot = vnum * num_inodes + inum;
+            if(!bitmap_get(v->ibm, inum) || bad_inodes[slot]) {
+                continue;
+            }
+
+            if(orphaned[slot]) {
+                continue;
+            }
+
+            inode* node = view_inode(v, inum);
+            int want = inum == root_inode ? 1 : links[slot];
+            if(want == 0) {
+                int fix = 0;
+                if(fixing(v)) {
+                    node->refs = 0;
+                    fix = link_orphan(inum) == 0;
+                }
+                report(fix, "%sinode %d isn't linked from any directory", vn, inum);
+                continue;
+            }
+            if(node->refs != want) {
+                report(fixing(v), "%sinode %d has %d references, %d entries point at it",
+                       vn, inum, node->refs, want);
+                if(fixing(v)) {
+                    node->refs = want;
+                }
+            }
+            if(!reached[slot]) {
+                report(0, "%sinode %d can't be reached from the root", vn, inum);
+            }
+        }
+    }
+}
+
+// compares what the scan counted with the page bitmap, reference
+// counts, dedup bitmap and fragment page headers
+static void
+check_pages()
+{
+    superblock* sb = get_superblock();
+    void* pbm = get_pages_bitmap();
+    uint8_t* refs = (uint8_t*)pages_get_page(0) + page_refs_offset;
+    void* dbm = get_dedup_bitmap();
+
+    for(int pnum = 1; pnum < num_pages; ++pnum) {
+        // past what the counts can hold a page just stays shared
+        int want = min(page_uses[pnum], UINT8_MAX + 1);
+        int have = bitmap_get(pbm, pnum) ? refs[pnum] + 1 : 0;
+
+        // the fragment page being filled can be empty for a moment
+        if(pnum == sb->frag_page && want == 0 && have == 1) {
+            want = 1;
+        }
+
+        if(want == 0 && have > 0) {
+            report(repair, "page %d is marked in use but nothing uses it", pnum);
+        }
+        else if(want > 0 && have == 0) {
+            report(repair, "page %d is in use but marked free", pnum);
+        }
+        else if(want != have) {
+            report(repair, "page %d has %d references, %d found", pnum, have, want);
+        }
+        if(repair && want != have) {
+            bitmap_put(pbm, pnum, want > 0);
+            refs[pnum] = max(want - 1, 0);
+        }
+
+        if(!want && bitmap_get(dbm, pnum)) {
+            report(repair, "free page %d is in the dedup index", pnum);
+            if(repair) {
+                bitmap_put(dbm, pnum, 0);
+            }
+        }
+
+        int used = 0;
+        for(int vnum = 0; vnum < nviews; ++vnum) {
+            used |= frag_masks[vnum * num_pages + pnum];
+        }
+        frag_header* hdr = pages_get_page(pnum);
+        if(used && hdr->used != (used | 1)) {
+            report(repair, "fragment page %d slots are %#x, tails use %#x",
+                   pnum, hdr->used, used | 1);
+            if(repair) {
+                hdr->used = used | 1;
+            }
+        }
+    }
+    if(repair) {
+        bitmap_put(pbm, 0, 1);
+    }
+}
+
+// compares one allocation group's counts with the bitmaps
+static void
+check_group(int group)
+{
+    alloc_group* gg = &get_groups()[group];
+    void* pbm = get_pages_bitmap();
+    char* ibm = get_inode_bitmap();
+    int free_pages = 0;
+    int free_inodes = 0;
+    int dirs = 0;
+    for(int ii = 0; ii < pages_per_group; ++ii) {
+        free_pages += !bitmap_get(pbm, group * pages_per_group + ii);
+    }
+    for(int ii = 0; ii < inodes_per_group; ++ii) {
+        int inum = group * inodes_per_group + ii;
+        if(!bitmap_get(ibm, inum)) {
+            free_inodes += 1;
+        }
+        else if(!bad_inodes[inum] && S_ISDIR(view_inode(&views[0], inum)->mode)) {
+            dirs += 1;
+        }
+    }
+
+    if(gg->free_pages != free_pages || gg->free_inodes != free_inodes || gg->dirs != dirs) {
+        report(repair, "group %d counts %d free pages, %d free inodes and %d "
+               "directories, found %d, %d and %d", group, gg->free_pages,
+               gg->free_inodes, gg->dirs, free_pages, free_inodes, dirs);
+        if(repair) {
+            gg->free_pages = free_pages;
+            gg->free_inodes = free_inodes;
+            gg->dirs = dirs;
+        }
+    }
+}
+
+// compares the free page and inode counts in the live superblock
+// with the bitmaps, after anything else has fixed the bitmaps
+static void
+check_counts()
+{
+    superblock* sb = get_superblock();
+    void* pbm = get_pages_bitmap();
+    char* ibm = get_inode_bitmap();
+    int* chunks = get_inode_chunks();
+    int free_pages = 0;
+    int free_inodes = 0;
+    int inode_chunks = 0;
+    for(int ii = 0; ii < num_pages; ++ii) {
+        free_pages += !bitmap_get(pbm, ii);
+    }
+    for(int ii = 0; ii < num_inodes; ++ii) {
+        free_inodes += !bitmap_get(ibm, ii);
+    }
+    for(int ii = 0; ii < num_inode_chunks; ++ii) {
+        inode_chunks += chunks[ii] != 0;
+    }
+
+    if(sb->free_pages != free_pages) {
+        report(repair, "superblock says %d pages are free, %d are", sb->free_pages, free_pages);
+        if(repair) {
+            sb->free_pages = free_pages;
+        }
+    }
+    if(sb->free_inodes != free_inodes) {
+        report(repair, "superblock says %d inodes are free, %d are", sb->free_inodes, free_inodes);
+        if(repair) {
+            sb->free_inodes = free_inodes;
+        }
+    }
+    if(sb->inode_chunks != inode_chunks) {
+        report(repair, "superblock says %d inode chunks are in use, %d are",
+               sb->inode_chunks, inode_chunks);
+        if(repair) {
+            sb->inode_chunks = inode_chunks;
+        }
+    }
+    for(int ii = 0; ii < num_groups; ++ii) {
+        check_group(ii);
+    }
+}
+
+// every inode in use has to be in a chunk, and every chunk has to
+// hold an inode in use. runs before the inodes are looked at
+static void
+check_chunks(int vnum)
+{
+    view* v = &views[vnum];
+    int fix = fixing(v);
+    char name[32];
+    const char* vn = view_name(v, name, sizeof(name));
+
+    for(int cc = 0; cc < num_inode_chunks; ++cc) {
+        int first = cc * inodes_per_chunk;
+        int used = 0;
+        for(int ii = first; ii < first + inodes_per_chunk; ++ii) {
+            used += bitmap_get(v->ibm, ii);
+        }
+
+        if(v->chunks[cc] && !page_ok(v->chunks[cc])) {
+            report(fix, "%sinode chunk %d is at page %d", vn, cc, v->chunks[cc]);
+            if(!fix) {
+                // don't look at its inodes at all
+                memset(bad_inodes + vnum * num_inodes + first, 1, inodes_per_chunk);
+                continue;
+            }
+            v->chunks[cc] = 0;
+        }
+
+        if(v->chunks[cc] == 0 && used) {
+            report(fix, "%sinodes %d - %d are in use but have no chunk",
+                   vn, first, first + inodes_per_chunk - 1);
+            memset(bad_inodes + vnum * num_inodes + first, 1, inodes_per_chunk);
+            for(int ii = first; fix && ii < first + inodes_per_chunk; ++ii) {
+                bitmap_put(v->ibm, ii, 0);
+            }
+        }
+        else if(v->chunks[cc] && !used) {
+            report(fix, "%sinode chunk %d has no inodes in use", vn, cc);
+            if(fix) {
+                v->chunks[cc] = 0;
+            }
+        }
+    }
+}
+
+// the pages every view uses outside of its inodes
+static void
+count_meta()
+{
+    superblock* sb = get_superblock();
+    for(int vnum = 0; vnum < nviews; ++vnum) {
+        page_uses[views[vnum].meta] += 1;
+        for(int ii = 0; ii < num_inode_chunks; ++ii) {
+            if(page_ok(views[vnum].chunks[ii])) {
+                page_uses[views[vnum].chunks[ii]] += 1;
+            }
+        }
+    }
+    if(page_ok(sb->snap_page)) {
+        page_uses[sb->snap_page] += 1;
+    }
+    if(page_ok(sb->dedup_page)) {
+        page_uses[sb->dedup_page] += 1;
+    }
+}
+
+// finds the live filesystem and its snapshots
+static int
+find_views()
+{
+    views[0].id = 0;
+    views[0].meta = 0;
+    nviews = 1;
+
+    superblock* sb = get_superblock();
+    if(sb->snap_page && !page_ok(sb->snap_page)) {
+        report(repair, "snapshot table page %d is out of range", sb->snap_page);
+        if(repair) {
+            sb->snap_page = 0;
+        }
+        return 0;
+    }
+
+    snapshot* table = snapshot_table();
+    for(int ii = 0; table && ii < SNAP_MAX; ++ii) {
+        if(table[ii].id == 0) {
+            continue;
+        }
+        if(!page_ok(table[ii].meta)) {
+            report(0, "snapshot %d has pages out of range", table[ii].id);
+            continue;
+        }
+        views[nviews].id = table[ii].id;
+        views[nviews].meta = table[ii].meta;
+        nviews += 1;
+    }
+    return 0;
+}
+
+// one full pass over the image
+static void
+check_image()
+{
+    memset(page_uses, 0, num_pages * sizeof(int));
+    memset(frag_seen, 0, MAX_VIEWS * num_pages);
+    memset(frag_masks, 0, MAX_VIEWS * num_pages * sizeof(int));
+    memset(links, 0, MAX_VIEWS * num_inodes * sizeof(int));
+    memset(bad_inodes, 0, MAX_VIEWS * num_inodes);
+    memset(reached, 0, MAX_VIEWS * num_inodes);
+    memset(orphaned, 0, MAX_VIEWS * num_inodes);
+
+    find_views();
+    for(int vnum = 0; vnum < nviews; ++vnum) {
+        char* meta = pages_get_page(views[vnum].meta);
+        views[vnum].ibm = meta + inode_bitmap_offset;
+        views[vnum].chunks = (int*)(meta + inode_chunks_offset);
+        views[vnum].orphans = (int*)(meta + orphans_offset);
+        check_chunks(vnum);
+    }
+
+    run_parallel(check_inode, nviews * num_inodes);
+    run_parallel(scan_inode, nviews * num_inodes);
+    count_meta();
+    check_pages();
+    for(int vnum = 0; vnum < nviews; ++vnum) {
+        check_orphans(vnum);
+    }
+    check_links();
+    check_counts();
+}
+
+int
+main(int argc, char* argv[])
+{
+    int opt;
+    nthreads = sysconf(_SC_NPROCESSORS_ONLN);
+    while((opt = getopt(argc, argv, "rj:")) != -1) {
+        switch(opt) {
+        case 'r':
+            repair = 1;
+            break;
+        case 'j':
+            nthreads = atoi(optarg);
+            break;
+        default:
+            return usage();
+        }
+    }
+    if(optind != argc - 1) {
+        return usage();
+    }
+    nthreads = clamp(nthreads, 1, 64);
+
+    const char* image = argv[optind];
+    struct stat st;
+    if(stat(image, &st) || st.st_size != num_pages * page_size) {
+        fprintf(stderr, "nufs-fsck: %s is not a nufs image\n", image);
+        return FSCK_FAILED;
+    }
+    pages_init(image, !repair);
+    superblock* sb = get_superblock();
+    if(sb->magic != nufs_magic || sb->version != nufs_version) {
+        fprintf(stderr, "nufs-fsck: %s has an unsupported layout\n", image);
+        return FSCK_FAILED;
+    }
+
+    page_uses = calloc(num_pages, sizeof(int));
+    frag_seen = calloc(MAX_VIEWS, num_pages);
+    frag_masks = calloc(MAX_VIEWS * num_pages, sizeof(int));
+    links = calloc(MAX_VIEWS * num_inodes, sizeof(int));
+    bad_inodes = calloc(MAX_VIEWS, num_inodes);
+    reached = calloc(MAX_VIEWS, num_inodes);
+    orphaned = calloc(MAX_VIEWS, num_inodes);
+
+    // checksums first, before repairs change anything
+    run_parallel(check_checksum, num_pages);
+    int left = problems - fixed;
+
+    // fixes can uncover more problems, go again until nothing changes.
+    // what the last pass couldn't fix is what is left
+    for(int pass = 1; ; ++pass) {
+        int seen = problems;
+        int was = fixed;
+        check_image();
+        if(fixed == was || pass == 4) {
+            left += (problems - seen) - (fixed - was);
+            break;
+        }
+        printf("rechecking\n");
+    }
+    if(repair && fixed) {
+        pages_checksum_all();
+    }
+
+    int used = num_pages - pages_free_count();
+    printf("%s: %d snapshots, %d pages used, %d problems fixed, %d left\n",
+           image, nviews - 1, used, fixed, left);
+    if(left) {
+        return FSCK_UNFIXED;
+    }
+    return fixed ? FSCK_FIXED : FSCK_OK;
+}
@@ -0,0 +1,234 @@
+// command line tool for copying a tree of files into a mounted nufs
+// filesystem, creating the files of each directory a batch at a time
+// instead of with a create, a write and a utimens each
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <dirent.h>
+#include <limits.h>
+#include <sys/stat.h>
+#include <sys/ioctl.h>
+
+#include "nufs_ioctl.h"
+
+static struct nufs_create batch;
+static int files = 0;
+static int batches = 0;
+
+static int
+usage()
+{
+    fprintf(stderr, "usage: nufs-import SOURCE DEST\n"
+                    "  copies the files, symlinks and directories under SOURCE\n"
+                    "  into the directory DEST on a mounted nufs filesystem\n");
+    return 1;
+}
+
+// bytes a record takes up in the batch, padded out to the next one
+static int
+rec_size(int name_len, int size)
+{
+    int len = sizeof(struct nufs_create_rec) + name_len + size;
+    return (len + 7) & ~7;
+}
+
+// creates everything in the batch in the directory open as dir_fd,
+// dest being its name for messages
+static int
+flush(int dir_fd, const char* dest)
+{
+    while(batch.count > 0) {
+        int count = batch.count;
+        if(ioctl(dir_fd, NUFS_IOC_CREATE, &batch) < 0) {
+            // the first record is the one that failed
+            struct nufs_create_rec rec;
+            memcpy(&rec, batch.buf, sizeof(rec));
+            fprintf(stderr, "nufs-import: %s/%.*s: %s\n", dest, (int)rec.name_len,
+                    batch.buf + sizeof(rec), strerror(errno));
+            return -1;
+        }
+        files += batch.count;
+        batches += 1;
+
+        // anything not created yet is sent again on its own, which
+        // either gets further or reports why it can't
+        int skip = 0;
+        for(int ii = 0; ii < batch.count; ++ii) {
+            struct nufs_create_rec rec;
+            memcpy(&rec, batch.buf + skip, sizeof(rec));
+            skip += rec_size(rec.name_len, rec.size);
+        }
+        memmove(batch.buf, batch.buf + skip, batch.used - skip);
+        batch.used -= skip;
+        batch.count = count - batch.count;
+    }
+    batch.used = 0;
+    return 0;
+}
+
+// adds a record to the batch, sending the batch first if it's full.
+// returns 1 if it doesn't fit even in an empty batch
+static int
+add(int dir_fd, const char* dest, const char* name, struct stat* st,
+    const char* data, int size)
+{
+    int name_len = strlen(name);
+    int len = rec_size(name_len, size);
+    if(len > NUFS_CREATE_BUF) {
+        return 1;
+    }
+    if(batch.used + len > NUFS_CREATE_BUF && flush(dir_fd, dest)) {
+        return -1;
+    }
+
+    struct nufs_create_rec rec = { 0 };
+    rec.mode = st->st_mode;
+    rec.name_len = name_len;
+    rec.size = size;
+    rec.mtime = st->st_mtime;
+    char* pos = batch.buf + batch.used;
+    memset(pos, 0, len);
+    memcpy(pos, &rec, sizeof(rec));
+    memcpy(pos + sizeof(rec), name, name_len);
+    memcpy(pos + sizeof(rec) + name_len, data, size);
+    batch.used += len;
+    batch.count += 1;
+    return 0;
+}
+
+// copies a file too big for a batch the slow way
+static int
+copy_file(const char* src, const char* dst, struct stat* st)
+{
+    int in = open(src, O_RDONLY);
+    int out = in < 0 ? -1 : open(dst, O_WRONLY | O_CREAT | O_EXCL, st->st_mode & 07777);
+    if(in < 0 || out < 0) {
+        perror(in < 0 ? src : dst);
+        if(in >= 0) {
+            close(in);
+        }
+        return -1;
+    }
+
+    char buf[65536];
+    ssize_t got;
+    int rv = 0;
+    while((got = read(in, buf, sizeof(buf))) > 0) {
+        if(write(out, buf, got) != got) {
+            perror(dst);
+            rv = -1;
+            break;
+        }
+    }
+    struct timespec times[2] = { st->st_atim, st->st_mtim };
+    futimens(out, times);
+    close(in);
+    close(out);
+    files += rv == 0;
+    return rv;
+}
+
+static int
+import_dir(const char* src, const char* dest)
+{
+    DIR* dir = opendir(src);
+    if(dir == 0) {
+        perror(src);
+        return -1;
+    }
+    int dir_fd = open(dest, O_RDONLY | O_DIRECTORY);
+    if(dir_fd < 0) {
+        perror(dest);
+        closedir(dir);
+        return -1;
+    }
+
+    char path[PATH_MAX];
+    char data[NUFS_CREATE_BUF];
+    int rv = 0;
+    struct dirent* ent;
+    while(rv == 0 && (ent = readdir(dir))) {
+        if(!strcmp(ent->d_name, ".") || !strcmp(ent->d_name, "..")) {
+            continue;
+        }
+        snprintf(path, sizeof(path), "%s/%s", src, ent->d_name);
+        struct stat st;
+        if(lstat(path, &st)) {
+            perror(path);
+            rv = -1;
+            break;
+        }
+
+        int size = 0;
+        if(S_ISLNK(st.st_mode)) {
+            size = readlink(path, data, sizeof(data) - 1);
+            if(size < 0) {
+                perror(path);
+                rv = -1;
+                break;
+            }
+            data[size++] = 0;
+        }
+        else if(S_ISREG(st.st_mode) && st.st_size < sizeof(data)) {
+            int fd = open(path, O_RDONLY);
+            size = fd < 0 ? -1 : read(fd, data, sizeof(data));
+            if(fd >= 0) {
+                close(fd);
+            }
+            if(size < 0) {
+                perror(path);
+                rv = -1;
+                break;
+            }
+        }
+        else if(!S_ISREG(st.st_mode) && !S_ISDIR(st.st_mode)) {
+            fprintf(stderr, "nufs-import: skipping %s\n", path);
+            continue;
+        }
+
+        int big = S_ISREG(st.st_mode) && st.st_size >= sizeof(data);
+        rv = big ? 1 : add(dir_fd, dest, ent->d_name, &st, data, size);
+        if(rv == 1) {
+            char dst[PATH_MAX];
+            snprintf(dst, sizeof(dst), "%s/%s", dest, ent->d_name);
+            rv = copy_file(path, dst, &st);
+        }
+    }
+    if(rv == 0) {
+        rv = flush(dir_fd, dest);
+    }
+    close(dir_fd);
+
+    // directories are only filled in once they have been created
+    rewinddir(dir);
+    while(rv == 0 && (ent = readdir(dir))) {
+        if(!strcmp(ent->d_name, ".") || !strcmp(ent->d_name, "..")) {
+            continue;
+        }
+        char dst[PATH_MAX];
+        snprintf(path, sizeof(path), "%s/%s", src, ent->d_name);
+        snprintf(dst, sizeof(dst), "%s/%s", dest, ent->d_name);
+        struct stat st;
+        if(lstat(path, &st) == 0 && S_ISDIR(st.st_mode)) {
+            rv = import_dir(path, dst);
+        }
+    }
+    closedir(dir);
+    return rv;
+}
+
+int
+main(int argc, char* argv[])
+{
+    if(argc != 3) {
+        return usage();
+    }
+
+    int rv = import_dir(argv[1], argv[2]);
+    printf("%s: %d files created in %d batches\n", argv[2], files, batches);
+    return rv ? 1 : 0;
+}
@@ -0,0 +1,367 @@
+// command line tool for looking at how the space in a nufs image
+// is used, and at individual inodes and directories in it
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/stat.h>
+
+#include "pages.h"
+#include "inode.h"
+#include "directory.h"
+#include "storage.h"
+#include "snapshot.h"
+#include "compress.h"
+#include "bitmap.h"
+#include "sizes.h"
+#include "util.h"
+
+// how many of the most fragmented files the summary lists
+#define WORST_FILES 10
+
+static int
+usage()
+{
+    fprintf(stderr, "usage: nufs-inspect [-s SNAPSHOT] [-f] IMAGE\n"
+                    "       nufs-inspect [-s SNAPSHOT] -i INUM IMAGE\n"
+                    "       nufs-inspect [-s SNAPSHOT] -d PATH IMAGE\n"
+                    "  -f  list the extents of every file\n"
+                    "  -i  dump an inode\n"
+                    "  -d  dump a directory\n");
+    return 1;
+}
+
+// what is known about each inode in use
+typedef struct file_info {
+    char* path; // first path it was found at
+    int pages; // data pages
+    int extents; // runs of consecutive data pages
+    int last; // last data page seen while counting
+} file_info;
+
+static file_info* files;
+
+static void
+count_extent(inode* node, int pnum, int kind, int index, void* arg)
+{
+    file_info* info = arg;
+    if(kind != INODE_PAGE_DATA) {
+        return;
+    }
+    if(info->pages == 0 || pnum != info->last + 1) {
+        info->extents += 1;
+    }
+    info->pages += 1;
+    info->last = pnum;
+}
+
+// prints the runs of consecutive pages holding a file
+static void
+print_extent(inode* node, int pnum, int kind, int index, void* arg)
+{
+    int* run = arg; // first page, length
+    if(kind != INODE_PAGE_DATA) {
+        return;
+    }
+    if(run[1] && pnum == run[0] + run[1]) {
+        run[1] += 1;
+        return;
+    }
+    if(run[1]) {
+        printf(" %d-%d", run[0], run[0] + run[1] - 1);
+    }
+    run[0] = pnum;
+    run[1] = 1;
+}
+
+static void
+print_extents(inode* node)
+{
+    int run[2] = { 0, 0 };
+    inode_for_each_page(node, print_extent, run);
+    if(run[1]) {
+        printf(" %d-%d", run[0], run[0] + run[1] - 1);
+    }
+    printf("\n");
+}
+
+// names every inode reachable from dir, depth first
+static void
+find_paths(const char* dir, int dinum)
+{
+    inode* dd = get_inode(dinum);
+    int npages = dd->size / page_size;
+    for(int ii = 0; ii < npages; ++ii) {
+        dirpage* pg = inode_get_page(dd, ii);
+        if(!dirpage_valid(pg)) {
+            continue;
+        }
+        char* end = (char*)pg + pg->used;
+        for(dirent* ent = (dirent*)(pg + 1); (char*)ent < end;
+            ent = (dirent*)((char*)ent + ent->len)) {
+            if(!dirent_valid(pg, ent)) {
+                break;
+            }
+            if(files[ent->inum].path) {
+                continue;
+            }
+
+            char* path = malloc(strlen(dir) + ent->name_len + 2);
+            sprintf(path, "%s/%s", streq(dir, "/") ? "" : dir, ent->name);
+            files[ent->inum].path = path;
+            if(S_ISDIR(get_inode(ent->inum)->mode)) {
+                find_paths(path, ent->inum);
+            }
+        }
+    }
+}
+
+static void
+report_space()
+{
+    void* pbm = get_pages_bitmap();
+    int used = 0;
+    for(int ii = 0; ii < num_pages; ++ii) {
+        used += ii == 0 || bitmap_get(pbm, ii);
+    }
+    int free_pages = num_pages - used;
+    printf("pages: %d total, %d used, %d free (%d%%)\n", num_pages, used,
+           free_pages, free_pages * 100 / num_pages);
+
+    // free runs bucketed by powers of two
+    int buckets[16] = { 0 };
+    int bucket_pages[16] = { 0 };
+    int runs = 0;
+    int largest = 0;
+    int largest_at = 0;
+    for(int ii = 1; ii < num_pages; ) {
+        if(bitmap_get(pbm, ii)) {
+            ii += 1;
+            continue;
+        }
+        int start = ii;
+        while(ii < num_pages && !bitmap_get(pbm, ii)) {
+            ii += 1;
+        }
+        int len = ii - start;
+        int bb = 0;
+        while((2 << bb) <= len) {
+            bb += 1;
+        }
+        buckets[bb] += 1;
+        bucket_pages[bb] += len;
+        runs += 1;
+        if(len > largest) {
+            largest = len;
+            largest_at = start;
+        }
+    }
+    printf("free runs: %d, largest %d pages at page %d\n", runs, largest, largest_at);
+    for(int bb = 0; bb < 16; ++bb) {
+        if(buckets[bb]) {
+            printf("  %4d-%-4d %4d runs %5d pages\n", 1 << bb, (2 << bb) - 1,
+                   buckets[bb], bucket_pages[bb]);
+        }
+    }
+
+    alloc_group* groups = get_groups();
+    printf("allocation groups:\n  group   pages  free  inodes  dirs\n");
+    for(int ii = 0; ii < num_groups; ++ii) {
+        printf("  %5d %3d-%-3d %5d %7d %5d\n", ii, ii * pages_per_group,
+               (ii + 1) * pages_per_group - 1, groups[ii].free_pages,
+               inodes_per_group - groups[ii].free_inodes, groups[ii].dirs);
+    }
+}
+
+static void
+report_inodes(int list)
+{
+    char* ibm = get_inode_bitmap();
+    int used = 0, regs = 0, dirs = 0, links = 0;
+    int inline_files = 0, tails = 0, compressed = 0;
+    int data_pages = 0, extents = 0, scattered = 0;
+
+    for(int ii = 0; ii < num_inodes; ++ii) {
+        if(!bitmap_get(ibm, ii)) {
+            continue;
+        }
+        inode* node = get_inode(ii);
+        used += 1;
+        regs += S_ISREG(node->mode);
+        dirs += S_ISDIR(node->mode);
+        links += S_ISLNK(node->mode);
+        inline_files += (node->flags & INODE_INLINE) != 0;
+        tails += (node->flags & INODE_TAIL) != 0;
+        compressed += compress_active(node);
+
+        file_info* info = &files[ii];
+        inode_for_each_page(node, count_extent, info);
+        if(!S_ISDIR(node->mode)) {
+            data_pages += info->pages;
+            extents += info->extents;
+            scattered += info->extents > 1;
+        }
+    }
+
+    int chunks = get_superblock()->inode_chunks;
+    printf("inodes: %d of %d in %d chunks used (%d%%): %d files, %d directories, %d symlinks\n",
+           used, chunks * inodes_per_chunk, chunks,
+           chunks ? used * 100 / (chunks * inodes_per_chunk) : 0, regs, dirs, links);
+    printf("  %d inline, %d with packed tails, %d compressed\n",
+           inline_files, tails, compressed);
+
+    // deleted files the reclaimer hasn't finished with
+    int* orphans = get_orphans();
+    int orphan_files = 0, orphan_pages = 0;
+    for(int ii = 0; ii < max_orphans; ++ii) {
+        if(orphans[ii] > 0 && orphans[ii] < num_inodes && bitmap_get(ibm, orphans[ii])) {
+            orphan_files += 1;
+            orphan_pages += files[orphans[ii]].pages;
+        }
+    }
+    printf("  %d deleted, %d pages still to be freed\n", orphan_files, orphan_pages);
+    printf("file data: %d pages in %d extents, %d files in more than one extent\n",
+           data_pages, extents, scattered);
+
+    // the files split into the most pieces
+    printf("most fragmented:\n  extents  pages  path\n");
+    char shown[num_inodes];
+    memset(shown, 0, sizeof(shown));
+    for(int nn = 0; nn < WORST_FILES; ++nn) {
+        int worst = -1;
+        for(int ii = 0; ii < num_inodes; ++ii) {
+            if(!bitmap_get(ibm, ii) || shown[ii] || S_ISDIR(get_inode(ii)->mode)) {
+                continue;
+            }
+            if(files[ii].extents > 1 && (worst < 0 || files[ii].extents > files[worst].extents)) {
+                worst = ii;
+            }
+        }
+        if(worst < 0) {
+            break;
+        }
+        shown[worst] = 1;
+        printf("  %7d %6d  %s\n", files[worst].extents, files[worst].pages,
+               files[worst].path ? files[worst].path : "(unlinked)");
+    }
+
+    printf("directories:\n  entries  pages  used  path\n");
+    for(int ii = 0; ii < num_inodes; ++ii) {
+        inode* dd = get_inode(ii);
+        if(!bitmap_get(ibm, ii) || !S_ISDIR(dd->mode)) {
+            continue;
+        }
+        int npages = dd->size / page_size;
+        int entries = 0, bytes = 0;
+        for(int jj = 0; jj < npages; ++jj) {
+            dirpage* pg = inode_get_page(dd, jj);
+            entries += pg->count;
+            bytes += pg->used;
+        }
+        printf("  %7d %6d %4d%%  %s\n", entries, npages,
+               npages ? bytes * 100 / (npages * page_size) : 0,
+               ii == root_inode ? "/" : files[ii].path ? files[ii].path : "(unlinked)");
+    }
+
+    if(list) {
+        printf("extents:\n");
+        for(int ii = 0; ii < num_inodes; ++ii) {
+            inode* node = get_inode(ii);
+            if(bitmap_get(ibm, ii) && !S_ISDIR(node->mode)) {
+                printf("  %s:", files[ii].path ? files[ii].path : "(unlinked)");
+                print_extents(node);
+            }
+        }
+    }
+}
+
+static int
+dump_inode(int inum)
+{
+    if(inum < 0 || inum >= num_inodes || !bitmap_get(get_inode_bitmap(), inum)) {
+        fprintf(stderr, "nufs-inspect: inode %d is not in use\n", inum);
+        return 1;
+    }
+    inode* node = get_inode(inum);
+    printf("inode %d: %s\n", inum, files[inum].path ? files[inum].path : "(unlinked)");
+    print_inode(node);
+    printf("extents:");
+    print_extents(node);
+    return 0;
+}
+
+static int
+dump_directory(const char* path)
+{
+    int inum;
+    inode* dd;
+    if(path_get_inode(path, &inum, &dd) || !S_ISDIR(dd->mode)) {
+        fprintf(stderr, "nufs-inspect: %s is not a directory\n", path);
+        return 1;
+    }
+    printf("directory %s, inode %d, %d pages\n", path, inum, dd->size / page_size);
+    print_directory(dd);
+    return 0;
+}
+
+int
+main(int argc, char* argv[])
+{
+    int opt;
+    int snap = 0;
+    int list = 0;
+    int inum = -1;
+    const char* dir = 0;
+    while((opt = getopt(argc, argv, "s:fi:d:")) != -1) {
+        switch(opt) {
+        case 's':
+            snap = atoi(optarg);
+            break;
+        case 'f':
+            list = 1;
+            break;
+        case 'i':
+            inum = atoi(optarg);
+            break;
+        case 'd':
+            dir = optarg;
+            break;
+        default:
+            return usage();
+        }
+    }
+    if(optind != argc - 1) {
+        return usage();
+    }
+
+    const char* image = argv[optind];
+    struct stat st;
+    if(stat(image, &st) || st.st_size != num_pages * page_size) {
+        fprintf(stderr, "nufs-inspect: %s is not a nufs image\n", image);
+        return 1;
+    }
+    pages_init(image, 1);
+    superblock* sb = get_superblock();
+    if(sb->magic != nufs_magic || sb->version != nufs_version) {
+        fprintf(stderr, "nufs-inspect: %s has an unsupported layout\n", image);
+        return 1;
+    }
+    if(snap && snapshot_open(snap)) {
+        fprintf(stderr, "nufs-inspect: no snapshot %d in %s\n", snap, image);
+        return 1;
+    }
+
+    files = calloc(num_inodes, sizeof(file_info));
+    find_paths("/", root_inode);
+    if(inum >= 0) {
+        return dump_inode(inum);
+    }
+    if(dir) {
+        return dump_directory(dir);
+    }
+
+    report_space();
+    report_inodes(list);
+    return 0;
+}
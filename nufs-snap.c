@@ -0,0 +1,191 @@
+// command line tool for taking, listing and exporting snapshots
+// of a nufs image
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <time.h>
+#include <sys/mman.h>
+#include <sys/ioctl.h>
+
+#include "pages.h"
+#include "inode.h"
+#include "bitmap.h"
+#include "snapshot.h"
+#include "sizes.h"
+#include "util.h"
+#include "nufs_ioctl.h"
+
+static int
+usage()
+{
+    fprintf(stderr, "usage: nufs-snap create MOUNT\n"
+                    "       nufs-snap delete MOUNT ID\n"
+                    "       nufs-snap list IMAGE\n"
+                    "       nufs-snap export IMAGE ID OUTPUT\n");
+    return 1;
+}
+
+// issues a snapshot ioctl against a mounted filesystem
+static int
+snap_ioctl(const char* mount, unsigned long cmd, int* id)
+{
+    int fd = open(mount, O_RDONLY);
+    if(fd < 0) {
+        perror(mount);
+        return 1;
+    }
+
+    int rv = ioctl(fd, cmd, id);
+    close(fd);
+    if(rv < 0) {
+        perror("ioctl");
+        return 1;
+    }
+    return 0;
+}
+
+static int
+snap_list(const char* image)
+{
+    pages_init(image, 1);
+    snapshot* table = snapshot_table();
+    for(int ii = 0; table && ii < SNAP_MAX; ++ii) {
+        if(table[ii].id) {
+            printf("%4d  %s", table[ii].id, ctime(&table[ii].time));
+        }
+    }
+    return 0;
+}
+
+// the image being written by export, and how many times each page
+// of it is referenced
+typedef struct export_state {
+    uint8_t* base;
+    int* refs;
+    char* used;
+} export_state;
+
+static void
+export_page(inode* node, int pnum, int kind, int index, void* arg)
+{
+    export_state* out = arg;
+
+    // fragment pages hold many tails but are only one reference
+    if(kind != INODE_PAGE_TAIL || !out->used[pnum]) {
+        out->refs[pnum] += 1;
+    }
+    out->used[pnum] = 1;
+    memcpy(out->base + pnum * page_size, pages_get_page(pnum), page_size);
+}
+
+// writes a snapshot out as an image of its own, pages keep the same
+// page numbers so nothing inside of them needs to be rewritten
+static int
+snap_export(const char* image, int id, const char* output)
+{
+    pages_init(image, 1);
+    if(snapshot_open(id)) {
+        fprintf(stderr, "nufs-snap: no snapshot %d in %s\n", id, image);
+        return 1;
+    }
+
+    int fd = open(output, O_CREAT | O_TRUNC | O_RDWR, 0644);
+    if(fd < 0 || ftruncate(fd, num_pages * page_size)) {
+        perror(output);
+        return 1;
+    }
+    int refs[num_pages];
+    char used[num_pages];
+    memset(refs, 0, sizeof(refs));
+    memset(used, 0, sizeof(used));
+    export_state out = { 0, refs, used };
+    out.base = mmap(0, num_pages * page_size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+    if(out.base == MAP_FAILED) {
+        perror("mmap");
+        return 1;
+    }
+
+    // the snapshot's superblock page and inode chunks become the real ones
+    memcpy(out.base, pages_get_page(0), page_size);
+    used[0] = 1;
+    int* chunks = get_inode_chunks();
+    for(int ii = 0; ii < num_inode_chunks; ++ii) {
+        if(chunks[ii]) {
+            memcpy(out.base + chunks[ii] * page_size, pages_get_page(chunks[ii]), page_size);
+            used[chunks[ii]] = 1;
+        }
+    }
+
+    char* ibm = get_inode_bitmap();
+    for(int ii = 0; ii < num_inodes; ++ii) {
+        if(bitmap_get(ibm, ii)) {
+            inode_for_each_page(get_inode(ii), export_page, &out);
+        }
+    }
+
+    // rebuild the page bitmap and reference counts for just this image
+    void* pbm = out.base + pages_bitmap_offset;
+    uint8_t* out_refs = out.base + page_refs_offset;
+    for(int ii = 0; ii < num_pages; ++ii) {
+        bitmap_put(pbm, ii, used[ii]);
+        out_refs[ii] = clamp(refs[ii] - 1, 0, UINT8_MAX);
+    }
+    superblock* sb = (superblock*)(out.base + superblock_offset);
+    alloc_group* groups = (alloc_group*)(out.base + groups_offset);
+    sb->free_pages = 0;
+    for(int ii = 0; ii < num_groups; ++ii) {
+        groups[ii].free_pages = 0;
+    }
+    for(int ii = 0; ii < num_pages; ++ii) {
+        sb->free_pages += !used[ii];
+        groups[ii / pages_per_group].free_pages += !used[ii];
+    }
+    sb->frag_page = 0;
+    sb->snap_page = 0;
+    sb->dedup_page = 0;
+    memset(out.base + dedup_bitmap_offset, 0, num_pages / 8);
+
+    // and checksums for the pages as they are now, page 0 last
+    uint32_t* csums = (uint32_t*)(out.base + page_csums_offset);
+    for(int ii = 1; ii < num_pages; ++ii) {
+        csums[ii] = page_checksum(out.base + ii * page_size, ii);
+    }
+    csums[0] = page_checksum(out.base, 0);
+
+    munmap(out.base, num_pages * page_size);
+    close(fd);
+    return 0;
+}
+
+int
+main(int argc, char* argv[])
+{
+    if(argc < 3) {
+        return usage();
+    }
+
+    int id = 0;
+    if(streq(argv[1], "create") && argc == 3) {
+        int rv = snap_ioctl(argv[2], NUFS_IOC_SNAPSHOT, &id);
+        if(rv == 0) {
+            printf("%d\n", id);
+        }
+        return rv;
+    }
+    else if(streq(argv[1], "delete") && argc == 4) {
+        id = atoi(argv[3]);
+        return snap_ioctl(argv[2], NUFS_IOC_SNAPDEL, &id);
+    }
+    else if(streq(argv[1], "list") && argc == 3) {
+        return snap_list(argv[2]);
+    }
+    else if(streq(argv[1], "export") && argc == 5) {
+        return snap_export(argv[2], atoi(argv[3]), argv[4]);
+    }
+
+    return usage();
+}
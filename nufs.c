@@ -9,12 +9,193 @@
 #include <dirent.h>
 #include <bsd/string.h>
 #include <assert.h>
+#include <limits.h>
+#include <stdlib.h>
+#include <stddef.h>
+#include <fcntl.h>
+#include <linux/fs.h>
+#include <pthread.h>
 
-#define FUSE_USE_VERSION 26
+#define FUSE_USE_VERSION 35
 #include <fuse.h>
 #include "storage.h"
 #include "inode.h"
 #include "util.h"
+#include "nufs_ioctl.h"
+#include "scrub.h"
+#include "defrag.h"
+#include "reclaim.h"
+#include "uring.h"
+
+// absolute path of where we are mounted
+static char mount_point[PATH_MAX];
+
+// options nufs understands on top of fuse's own, passed with -o
+struct nufs_config {
+    int snapshot; // mount this snapshot read-only instead
+    int dedup; // share identical pages as they are written
+    int scrub; // seconds per pass over every page checking checksums
+    int defrag; // seconds between defragmenting everything, 0 never
+    int populate; // fault the whole image in when mounting
+    int mlock; // keep the superblock and inode table in memory
+    int hugepage; // ask for huge pages for the data pages
+    int advise; // tell the kernel about reads ahead of time
+    int uring; // cache pages ourselves, reading them with io_uring
+    int cache; // pages that cache keeps, 0 for the default
+    int atime; // STORAGE_NOATIME, STORAGE_STRICTATIME or 0 for relatime
+    int writeback; // let the kernel cache writes and send them in bulk
+    int max_write; // largest write the kernel is asked to send at once
+};
+
+static struct nufs_config nufs_conf;
+
+// the kernel caches attributes and entries for this long unless told
+// otherwise with -o attr_timeout=SECONDS,entry_timeout=SECONDS. changes
+// it didn't ask for itself are invalidated as they happen, so this only
+// bounds how long a missed one could go unnoticed
+static const char* default_timeouts = "-oattr_timeout=60,entry_timeout=60";
+
+// paths whose cached attributes, entries and pages the kernel has to
+// drop. they are sent from a thread of their own, the kernel may be
+// holding locks for the request that made the change
+static struct fuse* nufs_fuse = 0;
+static pthread_mutex_t inval_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t inval_cond = PTHREAD_COND_INITIALIZER;
+static slist* inval_queue = 0;
+
+// names getattr has seen for files with more than one link, so a change
+// made through one name can invalidate what the kernel has for the
+// others. the oldest name is forgotten to make room for a new one
+#define ALIAS_COUNT 256
+typedef struct nufs_alias {
+    int inum;
+    char* path; // 0 if the slot is unused
+} nufs_alias;
+
+static nufs_alias aliases[ALIAS_COUNT];
+static int next_alias = 0;
+
+static
+void*
+invalidate_main(void* arg)
+{
+    for(;;) {
+        pthread_mutex_lock(&inval_lock);
+        while(inval_queue == 0) {
+            pthread_cond_wait(&inval_cond, &inval_lock);
+        }
+        slist* list = inval_queue;
+        inval_queue = 0;
+        pthread_mutex_unlock(&inval_lock);
+
+        for(slist* walk = list; walk; walk = walk->next) {
+            int rv = fuse_invalidate_path(nufs_fuse, walk->data);
+            printf("invalidate(%s) -> %d\n", walk->data, rv);
+        }
+        s_free(list);
+    }
+    return 0;
+}
+
+// queues path to be invalidated, inval_lock held
+static
+void
+invalidate_locked(const char* path)
+{
+    if(nufs_fuse) {
+        inval_queue = s_cons(path, inval_queue);
+        pthread_cond_signal(&inval_cond);
+    }
+}
+
+// tells the kernel path changed without it knowing
+static
+void
+invalidate(const char* path)
+{
+    pthread_mutex_lock(&inval_lock);
+    invalidate_locked(path);
+    pthread_mutex_unlock(&inval_lock);
+}
+
+// remembers path as a name of inode inum, or forgets it if it isn't one
+// of several names of a file any more
+static
+void
+alias_note(const char* path, struct stat* st)
+{
+    int keep = !S_ISDIR(st->st_mode) && st->st_nlink > 1;
+    pthread_mutex_lock(&inval_lock);
+    nufs_alias* slot = 0;
+    for(int ii = 0; ii < ALIAS_COUNT; ++ii) {
+        if(aliases[ii].path && streq(aliases[ii].path, path)) {
+            slot = &aliases[ii];
+            break;
+        }
+    }
+    if(slot == 0 && keep) {
+        slot = &aliases[next_alias];
+        next_alias = (next_alias + 1) % ALIAS_COUNT;
+        free(slot->path);
+        slot->path = strdup(path);
+    }
+    if(slot && keep) {
+        slot->inum = st->st_ino;
+    }
+    else if(slot) {
+        free(slot->path);
+        slot->path = 0;
+    }
+    pthread_mutex_unlock(&inval_lock);
+}
+
+// from was renamed to to, replacing whatever was there. names at or
+// under from move along with it
+static
+void
+alias_renamed(const char* from, const char* to)
+{
+    int from_len = strlen(from);
+    pthread_mutex_lock(&inval_lock);
+    for(int ii = 0; ii < ALIAS_COUNT; ++ii) {
+        if(aliases[ii].path && streq(aliases[ii].path, to)) {
+            free(aliases[ii].path);
+            aliases[ii].path = 0;
+        }
+    }
+    for(int ii = 0; ii < ALIAS_COUNT; ++ii) {
+        char* path = aliases[ii].path;
+        if(path && strncmp(path, from, from_len) == 0 &&
+           (path[from_len] == 0 || path[from_len] == '/')) {
+            char* moved = malloc(strlen(to) + strlen(path + from_len) + 1);
+            sprintf(moved, "%s%s", to, path + from_len);
+            free(path);
+            aliases[ii].path = moved;
+        }
+    }
+    pthread_mutex_unlock(&inval_lock);
+}
+
+// the file at path changed, the kernel knows about that name but not
+// about any other names the file has
+static
+void
+alias_changed(const char* path)
+{
+    pthread_mutex_lock(&inval_lock);
+    for(int ii = 0; ii < ALIAS_COUNT; ++ii) {
+        if(aliases[ii].path && streq(aliases[ii].path, path)) {
+            int inum = aliases[ii].inum;
+            for(int jj = 0; jj < ALIAS_COUNT; ++jj) {
+                if(jj != ii && aliases[jj].path && aliases[jj].inum == inum) {
+                    invalidate_locked(aliases[jj].path);
+                }
+            }
+            break;
+        }
+    }
+    pthread_mutex_unlock(&inval_lock);
+}
 
 // implementation for: man 2 access
 // Checks if a file exists.
@@ -22,7 +203,9 @@ int
 nufs_access(const char *path, int mask)
 {
     struct stat st;
+    storage_begin();
     int rv = storage_stat(path, &st);
+    rv = storage_end(rv);
     if(!rv) {
         printf("mode %04o\n", st.st_mode);
         // always assume owner
@@ -41,30 +224,49 @@ nufs_access(const char *path, int mask)
 // implementation for: man 2 stat
 // gets an object's attributes (type, permissions, size, etc)
 int
-nufs_getattr(const char *path, struct stat *st)
+nufs_getattr(const char *path, struct stat *st, struct fuse_file_info* fi)
 {
+    storage_begin();
     int rv = storage_stat(path, st);
+    rv = storage_end(rv);
+    if(!rv) {
+        alias_note(path, st);
+    }
     printf("getattr(%s) -> (%d) {mode: %04o, size: %ld}\n", path, rv, st->st_mode, st->st_size);
     return rv;
 }
 
+// implementation for: man 2 statfs
+// reports free space and inodes
+int
+nufs_statfs(const char* path, struct statvfs* st)
+{
+    storage_begin();
+    int rv = storage_end(storage_statfs(st));
+    printf("statfs(%s) -> %d {free: %lu pages, %lu inodes}\n", path, rv,
+           (unsigned long)st->f_bfree, (unsigned long)st->f_ffree);
+    return rv;
+}
+
 // implementation for: man 2 readdir
 // lists the contents of a directory
 int
 nufs_readdir(const char *path, void *buf, fuse_fill_dir_t filler,
-             off_t offset, struct fuse_file_info *fi)
+             off_t offset, struct fuse_file_info *fi, enum fuse_readdir_flags flags)
 {
     struct stat st;
     int rv = 0;
     memset(&st, 0, sizeof(st));
 
     // get storage information
-    filler(buf, ".", &st, 0); // current directory
-    filler(buf, "..", &st, 0); // stat of parent dir handled by fuse
+    filler(buf, ".", &st, 0, 0); // current directory
+    filler(buf, "..", &st, 0, 0); // stat of parent dir handled by fuse
 
     // collect information on all files in the directory
-    slist* list = storage_list(path); // list of files/dirs in path
-    if(list != 0) {
+    storage_begin();
+    slist* list;
+    rv = storage_list(path, &list); // list of files/dirs in path
+    if(rv == 0) {
         slist* walk = list;
         while(walk) {
             // wonky way of creating a full path 
@@ -76,13 +278,15 @@ nufs_readdir(const char *path, void *buf, fuse_fill_dir_t filler,
             if(rv) {
                 break;
             }
-            filler(buf, walk->data, &st, 0); // adding to output 
+            filler(buf, walk->data, &st, 0, 0); // adding to output 
             walk = walk->next;
         }
     }
 
+    s_free(list);
+    rv = storage_end(rv);
     printf("readdir(%s) -> %d\n", path, rv);
-    return 0;
+    return rv;
 }
 
 // mknod makes a filesystem object like a file or directory
@@ -90,7 +294,9 @@ nufs_readdir(const char *path, void *buf, fuse_fill_dir_t filler,
 int
 nufs_mknod(const char *path, mode_t mode, dev_t rdev)
 {
+    storage_begin();
     int rv = storage_mknod(path, mode);
+    rv = storage_end(rv);
     printf("mknod(%s, %04o) -> %d\n", path, mode, rv);
     return rv;
 }
@@ -108,7 +314,14 @@ nufs_mkdir(const char *path, mode_t mode)
 int
 nufs_unlink(const char *path)
 {
+    storage_begin();
     int rv = storage_unlink(path);
+    rv = storage_end(rv);
+    if(!rv) {
+        struct stat gone = { 0 };
+        alias_changed(path);
+        alias_note(path, &gone);
+    }
     printf("unlink(%s) -> %d\n", path, rv);
     return rv;
 }
@@ -116,7 +329,20 @@ nufs_unlink(const char *path)
 int
 nufs_link(const char *from, const char *to)
 {
+    struct stat st;
+    storage_begin();
     int rv = storage_link(from, to);
+    if(!rv) {
+        rv = storage_stat(to, &st);
+    }
+    rv = storage_end(rv);
+    if(!rv) {
+        // the kernel only looks up to, from and any other names keep
+        // the old link count cached unless told
+        alias_note(from, &st);
+        alias_note(to, &st);
+        alias_changed(to);
+    }
     printf("link(%s => %s) -> %d\n", from, to, rv);
 	return rv;
 }
@@ -124,53 +350,104 @@ nufs_link(const char *from, const char *to)
 int
 nufs_rmdir(const char *path)
 {
+    storage_begin();
     int rv = storage_unlink(path);
+    rv = storage_end(rv);
     printf("rmdir(%s) -> %d\n", path, rv);
     return rv;
 }
 
 // implements: man 2 rename
-// called to move a file within the same filesystem
+// called to move a file within the same filesystem. RENAME_NOREPLACE
+// is easy to honor, RENAME_EXCHANGE isn't supported
 int
-nufs_rename(const char *from, const char *to)
+nufs_rename(const char *from, const char *to, unsigned int flags)
 {
-    int rv = storage_rename(from, to);
+    struct stat st;
+    if(flags & ~RENAME_NOREPLACE) {
+        return -EINVAL;
+    }
+
+    storage_begin();
+    int rv = 0;
+    if((flags & RENAME_NOREPLACE) && storage_stat(to, &st) == 0) {
+        rv = -EEXIST;
+    }
+    if(rv == 0) {
+        rv = storage_rename(from, to);
+    }
+    rv = storage_end(rv);
+    if(!rv) {
+        // whatever was at to lost a name
+        alias_changed(to);
+        alias_renamed(from, to);
+    }
     printf("rename(%s => %s) -> %d\n", from, to, rv);
     return rv;
 }
 
 int
-nufs_chmod(const char *path, mode_t mode)
+nufs_chmod(const char *path, mode_t mode, struct fuse_file_info* fi)
 {
+    storage_begin();
     int rv = storage_chmod(path, mode);
+    rv = storage_end(rv);
+    if(rv >= 0) {
+        alias_changed(path);
+    }
     printf("chmod(%s, %04o) -> %d\n", path, mode, rv);
     return rv;
 }
 
 int
-nufs_truncate(const char *path, off_t size)
+nufs_truncate(const char *path, off_t size, struct fuse_file_info* fi)
 {
+    storage_begin();
     int rv = storage_truncate(path, size);
+    rv = storage_end(rv);
+    if(rv >= 0) {
+        alias_changed(path);
+    }
     printf("truncate(%s, %ld bytes) -> %d\n", path, size, rv);
     return rv;
 }
 
-// this is called on open, but doesn't need to do much
-// since FUSE doesn't assume you maintain state for
-// open files.
+// this is called on open. FUSE doesn't assume you maintain state
+// for open files, only handles that can write are counted, so closing
+// a reader leaves a writer's reservation window alone
 int
 nufs_open(const char *path, struct fuse_file_info *fi)
 {
-    int rv = 0;
+    storage_begin();
+    int rv = storage_open(path, (fi->flags & O_ACCMODE) != O_RDONLY);
+    rv = storage_end(rv);
+    if(rv >= 0) {
+        // released by number, the name might be gone by then
+        fi->fh = rv;
+        rv = 0;
+    }
     printf("open(%s) -> %d\n", path, rv);
     return rv;
 }
 
+// the file was closed, this is the last we see of this open
+int
+nufs_release(const char *path, struct fuse_file_info *fi)
+{
+    storage_begin();
+    int rv = storage_release(fi->fh, (fi->flags & O_ACCMODE) != O_RDONLY);
+    rv = storage_end(rv);
+    printf("release(%s) -> %d\n", path, rv);
+    return rv;
+}
+
 // Actually read data
 int
 nufs_read(const char *path, char *buf, size_t size, off_t offset, struct fuse_file_info *fi)
 {
+    storage_begin();
     int rv = storage_read(path, buf, size, offset);
+    rv = storage_end(rv);
     printf("read(%s, %ld bytes, @+%ld) -> %d\n", path, size, offset, rv);
     return rv;
 }
@@ -179,36 +456,168 @@ nufs_read(const char *path, char *buf, size_t size, off_t offset, struct fuse_fi
 int
 nufs_write(const char *path, const char *buf, size_t size, off_t offset, struct fuse_file_info *fi)
 {
-    int rv = storage_write(path, buf, size, offset);;
+    storage_begin();
+    int rv = storage_write(path, buf, size, offset);
+    rv = storage_end(rv);
+    if(rv >= 0) {
+        alias_changed(path);
+    }
     printf("write(%s, %ld bytes, @+%ld) -> %d\n", path, size, offset, rv);
     return rv;
 }
 
 // Update the timestamps on a file or directory.
 int
-nufs_utimens(const char* path, const struct timespec ts[2])
+nufs_utimens(const char* path, const struct timespec ts[2], struct fuse_file_info* fi)
 {
+    storage_begin();
     int rv = storage_set_time(path, ts);
+    rv = storage_end(rv);
+    if(rv >= 0) {
+        alias_changed(path);
+    }
     printf("utimens(%s, [%ld, %ld; %ld %ld]) -> %d\n",
            path, ts[0].tv_sec, ts[0].tv_nsec, ts[1].tv_sec, ts[1].tv_nsec, rv);
 	return rv;
 }
 
+// finds the path inside of this filesystem of a file the calling
+// process has open as fd, by way of /proc
+static
+int
+fd_to_path(int fd, char* buf, size_t size)
+{
+    char link[64];
+    char target[PATH_MAX];
+    snprintf(link, sizeof(link), "/proc/%d/fd/%d", fuse_get_context()->pid, fd);
+    ssize_t len = readlink(link, target, sizeof(target) - 1);
+    if(len < 0) {
+        return -EBADF;
+    }
+    target[len] = 0;
+
+    // has to be a file on this mount
+    int mlen = strlen(mount_point);
+    if(strncmp(target, mount_point, mlen) != 0 || 
+       (target[mlen] != '/' && target[mlen] != 0)) {
+        return -EXDEV;
+    }
+
+    strlcpy(buf, target[mlen] ? target + mlen : "/", size);
+    return 0;
+}
+
 // Extended operations
 int
-nufs_ioctl(const char* path, int cmd, void* arg, struct fuse_file_info* fi,
+nufs_ioctl(const char* path, unsigned int cmd, void* arg, struct fuse_file_info* fi,
            unsigned int flags, void* data)
 {
-    int rv = -1;
+    int rv;
+    char src[PATH_MAX];
+
+    if(flags & FUSE_IOCTL_COMPAT) {
+        return -ENOSYS;
+    }
+
+    storage_begin();
+    switch(cmd) {
+    case NUFS_IOC_CLONE:
+        rv = fd_to_path(*(int*)data, src, sizeof(src));
+        if(!rv) {
+            rv = storage_clone_file(src, path);
+        }
+        break;
+    case NUFS_IOC_CLONERANGE: {
+        struct nufs_clone_range* range = data;
+        rv = fd_to_path(range->src_fd, src, sizeof(src));
+        if(!rv) {
+            rv = storage_clone(src, path, range->src_offset,
+                               range->src_length, range->dest_offset);
+        }
+        break;
+    }
+    case NUFS_IOC_SNAPSHOT:
+        rv = storage_snapshot();
+        if(rv > 0) {
+            *(int*)data = rv;
+            rv = 0;
+        }
+        break;
+    case NUFS_IOC_SNAPDEL:
+        rv = storage_snapshot_delete(*(int*)data);
+        break;
+    case FS_IOC_GETFLAGS:
+        rv = storage_get_flags(path, data);
+        break;
+    case FS_IOC_SETFLAGS:
+        rv = storage_set_flags(path, *(int*)data);
+        break;
+    case NUFS_IOC_STATS:
+        rv = storage_stats(data);
+        break;
+    case NUFS_IOC_DEDUP:
+        rv = storage_dedup();
+        if(rv >= 0) {
+            *(int*)data = rv;
+            rv = 0;
+        }
+        break;
+    case NUFS_IOC_DEFRAG:
+        rv = storage_defrag(path);
+        if(rv >= 0) {
+            *(int*)data = rv;
+            rv = 0;
+        }
+        break;
+    case NUFS_IOC_CREATE:
+        rv = storage_create_many(path, data);
+        break;
+    default:
+        rv = -ENOTTY;
+    }
+    rv = storage_end(rv);
+
+    // the kernel doesn't know what an ioctl changed
+    if(!rv && (cmd == NUFS_IOC_CLONE || cmd == NUFS_IOC_CLONERANGE)) {
+        invalidate(path);
+        alias_changed(path);
+    }
+    else if(!rv && cmd == NUFS_IOC_CREATE) {
+        invalidate(path);
+    }
     printf("ioctl(%s, %d, ...) -> %d\n", path, cmd, rv);
     return rv;
 }
 
+// implements: man 2 copy_file_range
+// copies between two files without the data going through the kernel,
+// sharing whole pages where it can
+ssize_t
+nufs_copy_file_range(const char* path_in, struct fuse_file_info* fi_in, off_t off_in,
+                     const char* path_out, struct fuse_file_info* fi_out, off_t off_out,
+                     size_t size, int flags)
+{
+    if(flags) {
+        return -EINVAL;
+    }
+    storage_begin();
+    int rv = storage_copy_range(path_in, off_in, path_out, off_out, size);
+    rv = storage_end(rv);
+    if(rv > 0) {
+        alias_changed(path_out);
+    }
+    printf("copy_file_range(%s @+%ld, %s @+%ld, %ld bytes) -> %d\n",
+           path_in, off_in, path_out, off_out, size, rv);
+    return rv;
+}
+
 // need this to create symlinks
 int
 nufs_symlink(const char* to, const char* from)
 {
+    storage_begin();
     int rv = storage_symlink(to, from);
+    rv = storage_end(rv);
     printf("symlink(%s, %s) -> %d\n", to, from, rv);
     return rv;
 }
@@ -217,11 +626,13 @@ nufs_symlink(const char* to, const char* from)
 int
 nufs_readlink(const char* path, char* buf, size_t size)
 {
+    storage_begin();
     int rv = storage_read(path, buf, size, 0);
+    rv = storage_end(rv);
     if(rv > 0) {
         rv = 0; 
     }
-    else {
+    else if(rv != -EIO) {
         rv = -ENOENT;
     } 
     printf("readlink(%s, %s, %d) -> %d\n", path, buf, size, rv);
@@ -229,12 +640,45 @@ nufs_readlink(const char* path, char* buf, size_t size)
 }
 
 
+// called once fuse is up and running, after it has forked into
+// the background, so threads have to be started from here
+void*
+nufs_init(struct fuse_conn_info* conn, struct fuse_config* cfg)
+{
+    pthread_t thread;
+    // libfuse trims max_write down to what its buffers hold
+    conn->max_write = nufs_conf.max_write;
+    if(nufs_conf.writeback && (conn->capable & FUSE_CAP_WRITEBACK_CACHE)) {
+        conn->want |= FUSE_CAP_WRITEBACK_CACHE;
+    }
+    else if(nufs_conf.writeback) {
+        fprintf(stderr, "nufs: the kernel can't cache writes\n");
+        storage_drop_flags(STORAGE_WRITEBACK);
+    }
+
+    nufs_fuse = fuse_get_context()->fuse;
+    if(pthread_create(&thread, 0, invalidate_main, 0)) {
+        perror("nufs: invalidate");
+        nufs_fuse = 0;
+    }
+    else {
+        pthread_detach(thread);
+    }
+    scrub_start(nufs_conf.scrub);
+    defrag_start(nufs_conf.defrag);
+    if(!nufs_conf.snapshot) {
+        reclaim_start();
+    }
+    return 0;
+}
+
 void
 nufs_init_ops(struct fuse_operations* ops)
 {
     memset(ops, 0, sizeof(struct fuse_operations));
     ops->access   = nufs_access;
     ops->getattr  = nufs_getattr;
+    ops->statfs   = nufs_statfs;
     ops->readdir  = nufs_readdir;
     ops->mknod    = nufs_mknod;
     ops->mkdir    = nufs_mkdir;
@@ -245,25 +689,83 @@ nufs_init_ops(struct fuse_operations* ops)
     ops->chmod    = nufs_chmod;
     ops->truncate = nufs_truncate;
     ops->open	  = nufs_open;
+    ops->release  = nufs_release;
     ops->read     = nufs_read;
     ops->write    = nufs_write;
     ops->utimens  = nufs_utimens;
     ops->ioctl    = nufs_ioctl;
+    ops->copy_file_range = nufs_copy_file_range;
     ops->symlink  = nufs_symlink;
     ops->readlink = nufs_readlink;
+    ops->init     = nufs_init;
 };
 
 struct fuse_operations nufs_ops;
 
+#define NUFS_OPT(t, p) { t, offsetof(struct nufs_config, p), 1 }
+static const struct fuse_opt nufs_opts[] = {
+    NUFS_OPT("snapshot=%d", snapshot),
+    NUFS_OPT("dedup", dedup),
+    NUFS_OPT("scrub=%d", scrub),
+    NUFS_OPT("defrag=%d", defrag),
+    NUFS_OPT("populate", populate),
+    NUFS_OPT("mlock", mlock),
+    NUFS_OPT("hugepage", hugepage),
+    NUFS_OPT("advise", advise),
+    NUFS_OPT("uring", uring),
+    NUFS_OPT("cache=%d", cache),
+    NUFS_OPT("writeback", writeback),
+    NUFS_OPT("max_write=%d", max_write),
+    { "noatime", offsetof(struct nufs_config, atime), STORAGE_NOATIME },
+    { "relatime", offsetof(struct nufs_config, atime), 0 },
+    { "strictatime", offsetof(struct nufs_config, atime), STORAGE_STRICTATIME },
+    FUSE_OPT_END
+};
+
 int
 main(int argc, char *argv[])
 {
-    assert(argc > 2 && argc < 6);
+    assert(argc > 2);
     //printf("TODO: mount %s as data file\n", argv[--argc]);
-    printf("Mounting %s as a data file\n", argv[--argc]);
+    char* data_file = argv[--argc];
+    printf("Mounting %s as a data file\n", data_file);
+
+    struct fuse_args args = FUSE_ARGS_INIT(argc, argv);
+    // ahead of the rest so they can be overridden
+    fuse_opt_insert_arg(&args, 1, default_timeouts);
+    nufs_conf.scrub = 60;
+    nufs_conf.max_write = 1024 * 1024;
+    if(fuse_opt_parse(&args, &nufs_conf, nufs_opts, 0) == -1) {
+        return 1;
+    }
+    if(nufs_conf.snapshot) {
+        // nothing ever changes a snapshot, its pages can be kept
+        fuse_opt_add_arg(&args, "-oro,kernel_cache");
+        nufs_conf.scrub = 0;
+        nufs_conf.defrag = 0;
+        nufs_conf.writeback = 0;
+    }
+
+    // the mount point is the last argument left for fuse
+    char* mnt = args.argv[args.argc - 1];
+    if(!realpath(mnt, mount_point)) {
+        strlcpy(mount_point, mnt, sizeof(mount_point));
+    }
+
     printf("sizeof inode = %d\n", (int)sizeof(inode));
-    storage_init(argv[argc]);
+    int flags = nufs_conf.dedup ? STORAGE_DEDUP : 0;
+    flags |= nufs_conf.populate ? STORAGE_POPULATE : 0;
+    flags |= nufs_conf.mlock ? STORAGE_MLOCK : 0;
+    flags |= nufs_conf.hugepage ? STORAGE_HUGEPAGE : 0;
+    flags |= nufs_conf.advise ? STORAGE_ADVISE : 0;
+    flags |= nufs_conf.uring ? STORAGE_URING : 0;
+    flags |= nufs_conf.atime;
+    flags |= nufs_conf.writeback ? STORAGE_WRITEBACK : 0;
+    if(nufs_conf.cache) {
+        uring_set_cache(nufs_conf.cache);
+    }
+    storage_init(data_file, nufs_conf.snapshot, flags);
     nufs_init_ops(&nufs_ops);
-    return fuse_main(argc, argv, &nufs_ops, NULL);
+    return fuse_main(args.argc, args.argv, &nufs_ops, NULL);
 }
 
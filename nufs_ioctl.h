@@ -0,0 +1,83 @@
+#ifndef NUFS_IOCTL_H
+#define NUFS_IOCTL_H
+
+#include <stdint.h>
+#include <sys/ioctl.h>
+
+/**
+ * ioctls understood by a mounted nufs filesystem. The kernel handles
+ * FICLONE/FICLONERANGE itself and never forwards them to FUSE, so
+ * the same operations are offered under nufs's own numbers
+ */
+
+// argument for NUFS_IOC_CLONERANGE, laid out like the kernel's
+// struct file_clone_range
+struct nufs_clone_range {
+    int64_t  src_fd;
+    uint64_t src_offset;
+    uint64_t src_length; // 0 means through the end of the source
+    uint64_t dest_offset;
+};
+
+// make the file the ioctl is issued on a copy-on-write clone of the
+// file open as *(int*)arg
+#define NUFS_IOC_CLONE      _IOW('N', 1, int)
+#define NUFS_IOC_CLONERANGE _IOW('N', 2, struct nufs_clone_range)
+
+// take a read-only snapshot of the whole filesystem, its id is
+// written back to *(int*)arg. delete one by id with SNAPDEL
+#define NUFS_IOC_SNAPSHOT   _IOR('N', 3, int)
+#define NUFS_IOC_SNAPDEL    _IOW('N', 4, int)
+
+// space usage of the image, counted in pages
+struct nufs_stats {
+    uint64_t pages_total;
+    uint64_t pages_free;
+    uint64_t pages_shared; // references to pages past the first, saved space
+    uint64_t dedup_merged; // pages ever freed by deduplication
+    uint64_t compress_raw; // pages compressed files would take raw
+    uint64_t compress_stored; // pages they take up compressed
+    uint64_t csum_errors; // pages found not to match their checksum
+    uint64_t bad_pages; // pages that still don't match
+    uint64_t scrub_passes; // times the scrubber went over every page
+    uint64_t scrub_pages; // pages the scrubber has checked
+};
+
+#define NUFS_IOC_STATS      _IOR('N', 5, struct nufs_stats)
+
+// dedups every file now, writing back the number of pages freed
+#define NUFS_IOC_DEDUP      _IOR('N', 6, int)
+
+// moves the file's pages into one run, writing back the number of
+// pages moved. on the root of the mount every file is defragmented
+// and free space is compacted toward the end of the image
+#define NUFS_IOC_DEFRAG     _IOR('N', 7, int)
+
+// creates many files in the directory the ioctl is issued on in one
+// operation, for restoring trees of small files. buf holds count
+// records, each a struct nufs_create_rec followed by its name (no
+// terminator) and then its contents, and the next one starting at a
+// multiple of 8 bytes. a symlink's contents are its target and its
+// terminating NUL, a directory has none. records are created in order
+// until one fails, count is set to how many were. the ioctl only fails
+// if the very first one does
+struct nufs_create_rec {
+    uint32_t mode;
+    uint32_t name_len;
+    uint32_t size; // bytes of contents
+    uint32_t pad;
+    int64_t  mtime;
+};
+
+#define NUFS_CREATE_BUF (16 * 1024 - 32) // ioctl arguments stay under 16KiB
+
+struct nufs_create {
+    uint32_t count;
+    uint32_t used; // bytes of buf the records take up
+    uint64_t pad;
+    char buf[NUFS_CREATE_BUF];
+};
+
+#define NUFS_IOC_CREATE     _IOWR('N', 8, struct nufs_create)
+
+#endif
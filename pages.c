@@ -2,6 +2,7 @@
 
 #define _GNU_SOURCE
 #include <string.h>
+#include <stdlib.h>
 
 #include <sys/mman.h>
 #include <sys/types.h>
@@ -13,80 +14,767 @@
 #include <stdio.h>
 #include <stdint.h>
 
+#include <pthread.h>
+
 #include "pages.h"
 #include "util.h"
 #include "bitmap.h"
 #include "sizes.h"
+#include "crc32c.h"
 
-const int PAGE_COUNT = 256;
-const int NUFS_SIZE  = 4096 * 256; // 1MB
+const int PAGE_COUNT = num_pages;
+const int NUFS_SIZE  = 4096 * num_pages; // 1MB
 
 static int   pages_fd   = -1;
 static void* pages_base =  0;
+static uint8_t* pages_meta = 0; // page 0, which is always in memory
+
+// when looking at a snapshot, page 0 is read from the snapshot's
+// copy of it instead, which points at its copies of the inode chunks
+static int pages_view = 0;
+static int pages_readonly = 0;
+static int pages_policy = 0;
+
+/**
+ * Page 0 holds a CRC-32C of every page (page 0's own leaving out the
+ * slot it is kept in). Everything that looks at pages does so between
+ * pages_begin and pages_end while holding the pages lock. The first
+ * time a page is looked at it is checked against its checksum, and at
+ * the end the checksums of every page that was looked at are
+ * recomputed, so a page changed by anything else is caught the next
+ * time it is used or by the scrubber
+ */
+static pthread_mutex_t pages_lock;
+static int pages_depth = 0;
+static char* pages_touched = 0; // looked at in this operation
+static void** pages_ptr = 0; // where each page touched is
+static int* pages_touch_list = 0;
+static int pages_touch_count = 0;
+static char* pages_bad = 0; // known not to match their checksum
+static int pages_errors = 0; // mismatches found in this operation
+static pages_health health;
+static int scrub_next = 1;
+
+/**
+ * A file being appended to holds a reservation window, a run of free
+ * pages its next pages are taken from, so files growing at the same
+ * time don't end up with their pages interleaved. A file that uses up
+ * its window gets one twice the size. Windows only live in memory,
+ * other allocations go around them, and they are all dropped when
+ * there is nothing else left
+ */
+#define WINDOW_MIN 8
+#define WINDOW_MAX 32
+#define WINDOW_COUNT 32
+
+typedef struct pages_window {
+    int owner; // inode the window is for, -1 if the slot is unused
+    int start; // first page of the window
+    int end; // page after the last one
+    int size; // pages it was opened with
+    long used; // when it was last allocated from
+} pages_window;
+
+static pages_window windows[WINDOW_COUNT];
+static char* pages_window_of = 0; // 1 + the window each page is in
+static long windows_clock = 0;
+
+// how page_touch gets hold of a page
+#define TOUCH_VERIFY 1 // check it against its checksum
+#define TOUCH_TRUST 2 // read it without checking it
+#define TOUCH_FRESH 3 // don't read it, it's about to be filled in
+
+static const pages_backend mmap_backend;
+static const pages_backend* backend = &mmap_backend;
+
+// picks where pages come from for the next pages_init
+void
+pages_set_backend(const pages_backend* ops)
+{
+    backend = ops ? ops : &mmap_backend;
+}
+
+// picks the PAGES_* mapping policies for the next pages_init
+void
+pages_set_policy(int policy)
+{
+    pages_policy = policy;
+}
 
+// applies the mapping policies that are hints rather than mmap flags,
+// none of them matter for correctness so failures are only reported
+static
 void
-pages_init(const char* path)
+pages_apply_policy()
 {
-    pages_fd = open(path, O_CREAT | O_RDWR, 0644);
+    // chunks allocated after mounting aren't locked until the next mount
+    if(pages_policy & PAGES_MLOCK) {
+        int* chunks = (int*)((char*)pages_base + inode_chunks_offset);
+        int rv = mlock(pages_base, page_size);
+        for(int ii = 0; ii < num_inode_chunks && rv == 0; ++ii) {
+            if(chunks[ii] > 0 && chunks[ii] < num_pages) {
+                rv = mlock((char*)pages_base + chunks[ii] * page_size, page_size);
+            }
+        }
+        if(rv) {
+            perror("nufs: mlock");
+        }
+    }
+    if((pages_policy & PAGES_HUGEPAGE) &&
+       madvise(pages_base, NUFS_SIZE, MADV_HUGEPAGE)) {
+        perror("nufs: madvise(MADV_HUGEPAGE)");
+    }
+}
+
+// the default backend maps the whole image, the kernel's page cache
+// does the reading and writing so there is nothing to do on put or sync
+static
+void*
+mmap_open(const char* path, int readonly)
+{
+    if(readonly) {
+        pages_fd = open(path, O_RDONLY);
+    }
+    else {
+        pages_fd = open(path, O_CREAT | O_RDWR, 0644);
+    }
     assert(pages_fd != -1);
 
+    int flags = MAP_SHARED;
+    if(pages_policy & PAGES_POPULATE) {
+        flags |= MAP_POPULATE;
+    }
+
+    if(readonly) {
+        pages_base = mmap(0, NUFS_SIZE, PROT_READ, flags, pages_fd, 0);
+        assert(pages_base != MAP_FAILED);
+        pages_apply_policy();
+        return pages_base;
+    }
+
     int rv = ftruncate(pages_fd, NUFS_SIZE);
     assert(rv == 0);
 
-    pages_base = mmap(0, NUFS_SIZE, PROT_READ | PROT_WRITE, MAP_SHARED, pages_fd, 0);
+    pages_base = mmap(0, NUFS_SIZE, PROT_READ | PROT_WRITE, flags, pages_fd, 0);
     assert(pages_base != MAP_FAILED);
-
-    void* pbm = get_pages_bitmap();
-    bitmap_put(pbm, 0, 1);
+    pages_apply_policy();
+    return pages_base;
 }
 
+static
 void
-pages_free()
+mmap_close()
 {
     int rv = munmap(pages_base, NUFS_SIZE);
     assert(rv == 0);
+    pages_base = 0;
+}
+
+static
+void*
+mmap_get(int pnum, int fresh)
+{
+    return (uint8_t*)pages_base + page_size * pnum;
+}
+
+static
+void
+mmap_nop(int pnum)
+{
+}
+
+static
+void
+mmap_sync()
+{
+}
+
+// with PAGES_ADVISE, starts reading the given pages in the
+// background so they aren't faulted in one at a time. runs of
+// consecutive pages are passed on together, 0 entries are skipped
+static
+void
+mmap_prefetch(const int* pnums, int count)
+{
+    if(!(pages_policy & PAGES_ADVISE)) {
+        return;
+    }
+
+    // WILLNEED rather than SEQUENTIAL, advice that sticks would split
+    // the mapping up into a piece for every range it was given for
+    int start = 0;
+    int run = 0;
+    for(int ii = 0; ii <= count; ++ii) {
+        int pnum = ii < count ? pnums[ii] : 0;
+        if(run && pnum == start + run) {
+            run += 1;
+            continue;
+        }
+        if(run) {
+            madvise((char*)pages_base + page_size * start, page_size * run, MADV_WILLNEED);
+        }
+        start = pnum;
+        run = pnum > 0 && pnum < PAGE_COUNT;
+    }
+}
+
+static const pages_backend mmap_backend = {
+    .name = "mmap",
+    .open = mmap_open,
+    .close = mmap_close,
+    .get = mmap_get,
+    .put = mmap_nop,
+    .dirty = mmap_nop,
+    .sync = mmap_sync,
+    .prefetch = mmap_prefetch,
+};
+
+void
+pages_init(const char* path, int readonly)
+{
+    crc32c_init();
+    if(!pages_touched) {
+        pthread_mutexattr_t attr;
+        pthread_mutexattr_init(&attr);
+        pthread_mutexattr_settype(&attr, PTHREAD_MUTEX_RECURSIVE);
+        pthread_mutex_init(&pages_lock, &attr);
+        pages_touched = calloc(PAGE_COUNT, 1);
+        pages_touch_list = calloc(PAGE_COUNT, sizeof(int));
+        pages_ptr = calloc(PAGE_COUNT, sizeof(void*));
+        pages_bad = calloc(PAGE_COUNT, 1);
+        pages_window_of = calloc(PAGE_COUNT, 1);
+    }
+    for(int ii = 0; ii < WINDOW_COUNT; ++ii) {
+        windows[ii].owner = -1;
+    }
+    memset(pages_window_of, 0, PAGE_COUNT);
+    pages_readonly = readonly;
+    pages_meta = backend->open(path, readonly);
+
+    if(!readonly) {
+        void* pbm = get_pages_bitmap();
+        bitmap_put(pbm, 0, 1);
+    }
+}
+
+// redirects page 0, and through it the inode chunks, to a snapshot's
+// copy of it in page meta
+void
+pages_set_view(int meta)
+{
+    pages_view = meta;
+}
+
+void
+pages_free()
+{
+    backend->close();
+    pages_meta = 0;
+}
+
+// the checksum table, always the live one even when looking at a
+// snapshot since pages are checked by their real page number
+static
+uint32_t*
+get_page_csums()
+{
+    return (uint32_t*)(pages_meta + page_csums_offset);
+}
+
+// computes the checksum a page should have
+uint32_t
+page_checksum(const void* page, int pnum)
+{
+    if(pnum != 0) {
+        return crc32c(0, page, page_size);
+    }
+
+    int skip = page_csums_offset + sizeof(uint32_t);
+    uint32_t crc = crc32c(0, page, page_csums_offset);
+    return crc32c(crc, (uint8_t*)page + skip, page_size - skip);
+}
+
+// checks a page against its checksum, counting it the first time it
+// is found not to match
+static
+int
+page_verify(int pnum, const void* page)
+{
+    if(page_checksum(page, pnum) == get_page_csums()[pnum]) {
+        pages_bad[pnum] = 0;
+        return 0;
+    }
+
+    if(!pages_bad[pnum]) {
+        fprintf(stderr, "nufs: checksum mismatch on page %d\n", pnum);
+        pages_bad[pnum] = 1;
+        health.csum_errors += 1;
+    }
+    return -1;
+}
+
+// remembers that a page was looked at during this operation, getting
+// hold of it from the backend until the operation ends
+static
+void*
+page_touch(int pnum, int how)
+{
+    if(pages_touched[pnum]) {
+        return pages_ptr[pnum];
+    }
+    pages_touched[pnum] = how;
+    pages_touch_list[pages_touch_count++] = pnum;
+    pages_ptr[pnum] = backend->get(pnum, how == TOUCH_FRESH);
+    if(how == TOUCH_VERIFY && page_verify(pnum, pages_ptr[pnum])) {
+        pages_errors += 1;
+    }
+    return pages_ptr[pnum];
 }
 
 void*
 pages_get_page(int pnum)
 {
-    return pages_base + 4096 * pnum;
+    if(pages_view && pnum == 0) {
+        pnum = pages_view;
+    }
+    if(pnum < 0 || pnum >= PAGE_COUNT) {
+        return backend->get(pnum, 0);
+    }
+    if(pages_depth) {
+        return page_touch(pnum, TOUCH_VERIFY);
+    }
+    // outside of an operation pages are never given back, which only
+    // works when the whole image is mapped. anything else would keep
+    // them pinned for good
+    assert(pnum == 0 || backend == &mmap_backend);
+    return pnum == 0 ? pages_meta : backend->get(pnum, 0);
+}
+
+// tells the backend which pages are about to be read so it can get
+// them all at once
+void
+pages_advise_read(const int* pnums, int count)
+{
+    backend->prefetch(pnums, count);
+}
+
+// starts an operation on the pages, they can't be used by anything
+// else until the matching pages_end
+void
+pages_begin()
+{
+    pthread_mutex_lock(&pages_lock);
+    pages_depth += 1;
+}
+
+// finishes an operation, bringing the checksums of the pages it
+// looked at up to date and having the backend write back the ones
+// that changed. returns the number of pages that were found not to
+// match their checksums along the way
+int
+pages_end()
+{
+    int errors = 0;
+    pages_depth -= 1;
+    if(pages_depth == 0) {
+        uint32_t* csums = get_page_csums();
+        int changed = 0;
+        for(int ii = 0; ii < pages_touch_count && !pages_readonly; ++ii) {
+            int pnum = pages_touch_list[ii];
+            if(pnum == 0) {
+                continue;
+            }
+            // a page changed if its checksum did
+            uint32_t crc = page_checksum(pages_ptr[pnum], pnum);
+            if(crc != csums[pnum] || pages_touched[pnum] == TOUCH_FRESH) {
+                backend->dirty(pnum);
+                changed = 1;
+            }
+            // a bad page keeps its old checksum so it keeps failing
+            if(!pages_bad[pnum]) {
+                csums[pnum] = crc;
+            }
+        }
+        // the other checksums live in page 0, so it goes last
+        if(!pages_readonly && pages_touch_count) {
+            uint32_t crc = page_checksum(pages_meta, 0);
+            if(crc != csums[0] || changed) {
+                backend->dirty(0);
+            }
+            if(!pages_bad[0]) {
+                csums[0] = crc;
+            }
+        }
+        backend->sync();
+
+        for(int ii = 0; ii < pages_touch_count; ++ii) {
+            int pnum = pages_touch_list[ii];
+            pages_touched[pnum] = 0;
+            pages_ptr[pnum] = 0;
+            backend->put(pnum);
+        }
+        pages_touch_count = 0;
+        errors = pages_errors;
+        pages_errors = 0;
+    }
+    pthread_mutex_unlock(&pages_lock);
+    return errors;
+}
+
+// recomputes every checksum from scratch, for a freshly formatted
+// image or one that has been repaired
+void
+pages_checksum_all()
+{
+    pages_begin();
+    for(int ii = 0; ii < PAGE_COUNT; ++ii) {
+        page_touch(ii, TOUCH_TRUST);
+        pages_bad[ii] = 0;
+    }
+    // the checksums themselves are filled in as the pages are let go
+    pages_end();
+}
+
+// checks the next count pages in use against their checksums, a
+// little at a time so the scrubber never holds the lock for long.
+// has to be called between pages_begin and pages_end
+void
+pages_scrub(int count)
+{
+    void* pbm = get_pages_bitmap();
+    for(int ii = 0; ii < count; ++ii) {
+        int pnum = scrub_next;
+        scrub_next += 1;
+        if(scrub_next == PAGE_COUNT) {
+            scrub_next = 1;
+            health.scrub_passes += 1;
+        }
+
+        // pages in use by this operation are already checked
+        if(bitmap_get(pbm, pnum) && !pages_touched[pnum]) {
+            page_verify(pnum, backend->get(pnum, 0));
+            backend->put(pnum);
+            health.scrub_pages += 1;
+        }
+    }
+}
+
+// fills in the checksum error and scrubbing counters
+void
+pages_get_health(pages_health* out)
+{
+    *out = health;
+    out->bad_pages = 0;
+    for(int ii = 0; ii < PAGE_COUNT; ++ii) {
+        out->bad_pages += pages_bad[ii];
+    }
 }
 
 void*
 get_pages_bitmap()
 {
-    return pages_get_page(0);
+    uint8_t* page = pages_get_page(0);
+    return (void*)(page + pages_bitmap_offset);
 }
 
 void*
 get_inode_bitmap()
 {
     uint8_t* page = pages_get_page(0);
-    return (void*)(page + 32);
+    return (void*)(page + inode_bitmap_offset);
+}
+
+// the page each chunk of inodes is in, 0 for chunks not allocated
+int*
+get_inode_chunks()
+{
+    uint8_t* page = pages_get_page(0);
+    return (int*)(page + inode_chunks_offset);
+}
+
+// pages whose contents are recorded in the dedup index, a bit is
+// cleared as soon as its page can no longer be trusted to match
+void*
+get_dedup_bitmap()
+{
+    uint8_t* page = pages_get_page(0);
+    return (void*)(page + dedup_bitmap_offset);
+}
+
+superblock*
+get_superblock()
+{
+    uint8_t* page = pages_get_page(0);
+    return (superblock*)(page + superblock_offset);
+}
+
+// what each allocation group has left
+alloc_group*
+get_groups()
+{
+    uint8_t* page = pages_get_page(0);
+    return (alloc_group*)(page + groups_offset);
+}
+
+// inodes whose pages are still being given back, 0 for a free slot
+int*
+get_orphans()
+{
+    uint8_t* page = pages_get_page(0);
+    return (int*)(page + orphans_offset);
 }
 
 int
 alloc_page()
+{
+    return alloc_page_near(1);
+}
+
+// gives back the pages of a reservation window
+static
+void
+window_drop(pages_window* win)
+{
+    for(int ii = win->start; ii < win->end; ++ii) {
+        pages_window_of[ii] = 0;
+    }
+    win->owner = -1;
+}
+
+// allocates the first free page from goal on, wrapping around to the
+// start of the image, so pages end up close to what they belong with.
+// pages in reservation windows are only used once nothing else is left
+int
+alloc_page_near(int goal)
 {
     void* pbm = get_pages_bitmap();
+    if(goal < 1 || goal >= PAGE_COUNT) {
+        goal = 1;
+    }
 
-    for (int ii = root_inode+1; ii < PAGE_COUNT; ++ii) {
-        if (!bitmap_get(pbm, ii)) {
-            bitmap_put(pbm, ii, 1);
-            printf("+ alloc_page() -> %d\n", ii);
-            return ii;
+    for(int pass = 0; pass < 2; ++pass) {
+        int reserved = 0;
+        for(int ii = 0; ii < PAGE_COUNT - 1; ++ii) {
+            int pnum = 1 + (goal - 1 + ii) % (PAGE_COUNT - 1);
+            if(bitmap_get(pbm, pnum)) {
+                continue;
+            }
+            if(pages_window_of[pnum]) {
+                reserved = 1;
+                continue;
+            }
+            return alloc_page_at(pnum);
+        }
+        if(!reserved) {
+            break;
+        }
+
+        printf("+ alloc_page_near(%d) dropping reservations\n", goal);
+        for(int ii = 0; ii < WINDOW_COUNT; ++ii) {
+            if(windows[ii].owner >= 0) {
+                window_drop(&windows[ii]);
+            }
         }
     }
 
     return -1;
 }
 
+// allocates a page for inode owner out of its reservation window,
+// opening a new window from goal on if it has none or used it up
+int
+alloc_page_for(int owner, int goal)
+{
+    if(owner < 0) {
+        return alloc_page_near(goal);
+    }
+
+    void* pbm = get_pages_bitmap();
+    pages_window* win = 0;
+    for(int ii = 0; ii < WINDOW_COUNT; ++ii) {
+        if(windows[ii].owner == owner) {
+            win = &windows[ii];
+        }
+    }
+
+    int size = WINDOW_MIN;
+    if(win) {
+        int from = (goal >= win->start && goal < win->end) ? goal : win->start;
+        for(int ii = from; ii < win->end; ++ii) {
+            if(!bitmap_get(pbm, ii)) {
+                win->used = ++windows_clock;
+                return alloc_page_at(ii);
+            }
+        }
+        size = min(win->size * 2, WINDOW_MAX);
+        window_drop(win);
+    }
+    else {
+        // an unused slot, or the one that has gone unused longest
+        win = &windows[0];
+        for(int ii = 0; ii < WINDOW_COUNT && win->owner >= 0; ++ii) {
+            if(windows[ii].owner < 0 || windows[ii].used < win->used) {
+                win = &windows[ii];
+            }
+        }
+        if(win->owner >= 0) {
+            window_drop(win);
+        }
+    }
+
+    int pnum = alloc_page_near(goal);
+    if(pnum < 0) {
+        return pnum;
+    }
+
+    // the window is the run of free pages after the one just taken
+    int end = pnum + 1;
+    while(end < PAGE_COUNT && end < pnum + size &&
+          !bitmap_get(pbm, end) && !pages_window_of[end]) {
+        end += 1;
+    }
+    win->owner = owner;
+    win->start = pnum;
+    win->end = end;
+    win->size = size;
+    win->used = ++windows_clock;
+    for(int ii = pnum; ii < end; ++ii) {
+        pages_window_of[ii] = 1 + (win - windows);
+    }
+    printf("+ alloc_page_for(%d) window %d-%d\n", owner, pnum, end - 1);
+    return pnum;
+}
+
+// allocates count pages for owner, each from the one before it on,
+// filling in pages. all or nothing, a failure frees what it got
+int
+alloc_pages_for(int owner, int goal, int* pages, int count)
+{
+    for(int ii = 0; ii < count; ++ii) {
+        int pnum = alloc_page_for(owner, ii ? pages[ii - 1] + 1 : goal);
+        if(pnum < 0) {
+            while(ii-- > 0) {
+                free_page(pages[ii]);
+            }
+            return -ENOSPC;
+        }
+        pages[ii] = pnum;
+    }
+    return 0;
+}
+
+// drops inode owner's reservation window, if it has one
+void
+pages_release_window(int owner)
+{
+    for(int ii = 0; ii < WINDOW_COUNT; ++ii) {
+        if(windows[ii].owner == owner) {
+            window_drop(&windows[ii]);
+        }
+    }
+}
+
+// whether page pnum is in a live reservation window
+int
+pages_reserved(int pnum)
+{
+    return pages_window_of[pnum] != 0;
+}
+
+// the page number of the page ptr points into, if that page was got
+// during this operation or the whole image is mapped, -1 otherwise
+int
+pages_find(const void* ptr)
+{
+    const char* base = pages_base;
+    if(base && (const char*)ptr >= base && (const char*)ptr < base + NUFS_SIZE) {
+        return ((const char*)ptr - base) / page_size;
+    }
+    for(int ii = 0; ii < pages_touch_count; ++ii) {
+        int pnum = pages_touch_list[ii];
+        const char* page = pages_ptr[pnum];
+        if((const char*)ptr >= page && (const char*)ptr < page + page_size) {
+            return pnum;
+        }
+    }
+    return -1;
+}
+
+// allocates page pnum in particular, -1 if it is already in use
+int
+alloc_page_at(int pnum)
+{
+    void* pbm = get_pages_bitmap();
+    if(bitmap_get(pbm, pnum)) {
+        return -1;
+    }
+
+    bitmap_put(pbm, pnum, 1);
+    get_superblock()->free_pages -= 1;
+    get_groups()[pnum / pages_per_group].free_pages -= 1;
+    // whatever was left in the page is about to be replaced
+    if(pages_depth) {
+        pages_bad[pnum] = 0;
+        page_touch(pnum, TOUCH_FRESH);
+    }
+    printf("+ alloc_page() -> %d\n", pnum);
+    return pnum;
+}
+
+// the number of pages not in use, kept up to date in the superblock
+int
+pages_free_count()
+{
+    return get_superblock()->free_pages;
+}
+
+// pages can be shared between files, page 0 keeps a count of the
+// references each page has past the first one
+static
+uint8_t*
+get_page_refs()
+{
+    uint8_t* page = pages_get_page(0);
+    return page + page_refs_offset;
+}
+
+// takes another reference to an allocated page, returning nonzero
+// if the page can't be shared any further
+int
+page_ref(int pnum)
+{
+    uint8_t* refs = get_page_refs();
+    if(refs[pnum] == UINT8_MAX) {
+        return -1;
+    }
+    refs[pnum] += 1;
+    return 0;
+}
+
+// returns how many references there are to a page
+int
+page_refs(int pnum)
+{
+    return get_page_refs()[pnum] + 1;
+}
+
+// drops a reference to a page, only freeing it once the last
+// reference is gone
 void
 free_page(int pnum)
 {
+    uint8_t* refs = get_page_refs();
+    if(refs[pnum] > 0) {
+        printf("+ free_page(%d) -> %d refs left\n", pnum, refs[pnum]);
+        refs[pnum] -= 1;
+        return;
+    }
+
     printf("+ free_page(%d)\n", pnum);
     void* pbm = get_pages_bitmap();
     bitmap_put(pbm, pnum, 0);
+    bitmap_put(get_dedup_bitmap(), pnum, 0);
+    get_superblock()->free_pages += 1;
+    get_groups()[pnum / pages_per_group].free_pages += 1;
 }
 
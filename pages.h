@@ -4,13 +4,92 @@
 #define PAGES_H
 
 #include <stdio.h>
+#include <stdint.h>
 
-void pages_init(const char* path);
+// lives in page 0 right after the bitmaps
+typedef struct superblock {
+    int magic; // nufs_magic once the image is formatted
+    int version; // on-image layout version
+    int frag_page; // fragment page new file tails are packed into
+    int snap_page; // table of snapshots, 0 until one is taken
+    int dedup_page; // fingerprint index of data pages, 0 until used
+    int dedup_merged; // data pages ever replaced by a shared copy
+    int free_pages; // pages not marked in the page bitmap
+    int free_inodes; // inodes not marked in the inode bitmap
+    int inode_chunks; // pages holding inodes
+} superblock;
+
+// what is left in each allocation group, kept in page 0 after the
+// inode chunk index
+typedef struct alloc_group {
+    int free_pages; // pages in the group not in use
+    int free_inodes; // inode numbers in the group not in use
+    int dirs; // directories among the group's inodes
+} alloc_group;
+
+// checksum mismatches found since the filesystem was mounted
+typedef struct pages_health {
+    long csum_errors; // pages found not to match their checksum
+    long bad_pages; // pages that still don't match
+    long scrub_passes; // times the scrubber has been over every page
+    long scrub_pages; // pages the scrubber has checked
+} pages_health;
+
+// how the image is mapped, set with pages_set_policy before pages_init
+#define PAGES_POPULATE 0x1 // fault the whole image in when mapping it
+#define PAGES_MLOCK 0x2 // keep the superblock and inode chunks in memory
+#define PAGES_HUGEPAGE 0x4 // ask for huge pages for the data pages
+#define PAGES_ADVISE 0x8 // tell the kernel about reads before making them
+
+/**
+ * Where pages come from. get returns a page that stays put until it
+ * is put back, fresh saying the contents don't matter since the page
+ * is about to be filled in. dirty marks a page that has to be written
+ * back before it can be dropped and sync writes back every page
+ * marked so far. prefetch is a hint that pages are about to be got
+ */
+typedef struct pages_backend {
+    const char* name;
+    void* (*open)(const char* path, int readonly);
+    void (*close)();
+    void* (*get)(int pnum, int fresh);
+    void (*put)(int pnum);
+    void (*dirty)(int pnum);
+    void (*sync)();
+    void (*prefetch)(const int* pnums, int count);
+} pages_backend;
+
+void pages_set_backend(const pages_backend* backend);
+void pages_set_policy(int policy);
+void pages_init(const char* path, int readonly);
+void pages_set_view(int meta);
 void pages_free();
 void* pages_get_page(int pnum);
 void* get_pages_bitmap();
 void* get_inode_bitmap();
+int* get_inode_chunks();
+alloc_group* get_groups();
+int* get_orphans();
+void* get_dedup_bitmap();
+superblock* get_superblock();
 int alloc_page();
+int alloc_page_near(int goal);
+int alloc_page_for(int owner, int goal);
+int alloc_pages_for(int owner, int goal, int* pages, int count);
+void pages_release_window(int owner);
+int pages_reserved(int pnum);
+int alloc_page_at(int pnum);
+int pages_find(const void* ptr);
 void free_page(int pnum);
+int pages_free_count();
+int page_ref(int pnum);
+int page_refs(int pnum);
+void pages_advise_read(const int* pnums, int count);
+void pages_begin();
+int pages_end();
+uint32_t page_checksum(const void* page, int pnum);
+void pages_checksum_all();
+void pages_scrub(int count);
+void pages_get_health(pages_health* out);
 
 #endif
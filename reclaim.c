@@ -0,0 +1,53 @@
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <pthread.h>
+#include <sched.h>
+#include <time.h>
+
+#include "reclaim.h"
+#include "storage.h"
+
+/**
+ * Unlinking or truncating a large file only moves it onto the orphan
+ * list in page 0. The reclaimer is a thread at idle priority that
+ * frees the pages of the files on the list a batch at a time, each
+ * batch an operation of its own so the storage lock is never held
+ * for long. The list is on the image, so orphans left by a crash are
+ * freed after the next mount
+ */
+
+// pages freed each time the reclaimer takes the lock
+static const int reclaim_batch = 32;
+
+// how long the reclaimer sleeps once there is nothing left to free
+static const long reclaim_idle_ns = 100 * 1000000;
+
+static
+void*
+reclaim_main(void* arg)
+{
+    struct sched_param param = { 0 };
+    pthread_setschedparam(pthread_self(), SCHED_IDLE, &param);
+
+    struct timespec ts = { 0, reclaim_idle_ns };
+    for(;;) {
+        if(storage_reclaim(reclaim_batch) > 0) {
+            sched_yield();
+        }
+        else {
+            nanosleep(&ts, 0);
+        }
+    }
+    return 0;
+}
+
+void
+reclaim_start()
+{
+    pthread_t thread;
+    if(pthread_create(&thread, 0, reclaim_main, 0)) {
+        perror("nufs: reclaim");
+        return;
+    }
+    pthread_detach(thread);
+}
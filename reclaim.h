@@ -0,0 +1,8 @@
+#ifndef RECLAIM_H
+#define RECLAIM_H
+
+// gives back the pages of deleted files on the orphan list in the
+// background, picking up whatever an earlier mount left behind
+void reclaim_start();
+
+#endif
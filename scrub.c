@@ -0,0 +1,61 @@
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <pthread.h>
+#include <sched.h>
+#include <time.h>
+
+#include "scrub.h"
+#include "storage.h"
+#include "sizes.h"
+
+/**
+ * The scrubber is a thread at idle priority that goes over the
+ * image a few pages at a time, so a pass is spread out over the
+ * whole interval and never keeps the storage lock away from a
+ * filesystem operation for longer than a handful of checksums
+ */
+
+// pages checked each time the scrubber wakes up
+static const int scrub_batch = 8;
+
+static
+void*
+scrub_main(void* arg)
+{
+    int interval = *(int*)arg;
+
+    struct sched_param param = { 0 };
+    pthread_setschedparam(pthread_self(), SCHED_IDLE, &param);
+
+    // sleep long enough between batches to take interval per pass
+    long wait = (long)interval * 1000000000 / (num_pages / scrub_batch);
+    struct timespec ts = { wait / 1000000000, wait % 1000000000 };
+
+    int reported = 0;
+    for(;;) {
+        nanosleep(&ts, 0);
+        int bad = storage_scrub(scrub_batch);
+        if(bad != reported) {
+            fprintf(stderr, "nufs: scrub found %d bad pages\n", bad);
+            reported = bad;
+        }
+    }
+    return 0;
+}
+
+void
+scrub_start(int interval)
+{
+    static int scrub_interval;
+    pthread_t thread;
+    if(interval <= 0) {
+        return;
+    }
+
+    scrub_interval = interval;
+    if(pthread_create(&thread, 0, scrub_main, &scrub_interval)) {
+        perror("nufs: scrub");
+        return;
+    }
+    pthread_detach(thread);
+}
@@ -0,0 +1,8 @@
+#ifndef SCRUB_H
+#define SCRUB_H
+
+// checks every page in use against its checksum in the background,
+// going over all of them once every interval seconds
+void scrub_start(int interval);
+
+#endif
@@ -11,18 +11,44 @@
 static const int page_size = 4096;
 
 // number of data blocks of page_size
-static const int num_pages = (1024 * 1024 * 1024) / page_size;
+static const int num_pages = (1024 * 1024) / page_size;
 
 // root node is always first inode
 static const int root_inode = 0;
 
-// we will have 256 inodes (even if all of them can't be used)
-// starting after block 0
-// sizeof(inode) = 40 (right now) so we need 2.5 -> 3 pages
-static const int inode_start_page = 1;
-static const int inode_end_page = 17; // page after inodes end
+// inodes are kept in chunks of one page each, allocated as they are
+// needed. sizeof(inode) = 256 so 16 of them fit in a chunk, inode
+// inum is slot inum % 16 of chunk inum / 16
+static const int inodes_per_chunk = 16;
 
-// number of available inodes after removing metadata
-static const int num_inodes = num_pages-1;
+// number of possible inodes, one per bit of the inode bitmap, enough
+// for as many chunks as there are pages
+static const int num_inode_chunks = 256;
+static const int num_inodes = 256 * 16;
+
+// the image is split into allocation groups, each a run of pages and
+// a range of inode numbers, so inodes and their pages stay together
+static const int num_groups = 8;
+static const int pages_per_group = 256 / 8;
+static const int inodes_per_group = 256 * 16 / 8;
+
+// layout of page 0, byte offsets of the pieces stored in it
+static const int pages_bitmap_offset = 0;
+static const int superblock_offset = 64;
+static const int page_refs_offset = 256;
+static const int dedup_bitmap_offset = 512;
+static const int page_csums_offset = 1024;
+static const int inode_bitmap_offset = 2048;
+static const int inode_chunks_offset = 2560; // page of each inode chunk
+static const int groups_offset = 3584;
+static const int orphans_offset = 3712; // inodes waiting to be reclaimed
+
+// large files being freed are put on the orphan list, the reclaimer
+// gives their pages back a batch at a time
+static const int max_orphans = 32;
+
+// identifies a formatted image and the layout it was written with
+static const int nufs_magic = 0x5346554E; // "NUFS"
+static const int nufs_version = 13;
 
 #endif 
@@ -0,0 +1,281 @@
+#include <stdio.h>
+#include <string.h>
+#include <errno.h>
+#include <stdint.h>
+#include <time.h>
+
+#include "snapshot.h"
+#include "inode.h"
+#include "compress.h"
+#include "pages.h"
+#include "bitmap.h"
+#include "sizes.h"
+
+/**
+ * A snapshot is a read-only copy of the whole filesystem. Taking one
+ * copies the metadata (superblock page, inode chunks, directory pages,
+ * indirect pointer pages and fragment pages) and takes a reference to
+ * every file data page, so the data itself is only copied when the
+ * live filesystem writes to a page afterwards
+ */
+
+// gets the snapshot table, 0 if no snapshot was ever taken
+snapshot*
+snapshot_table()
+{
+    superblock* sb = get_superblock();
+    if(sb->snap_page == 0) {
+        return 0;
+    }
+    return pages_get_page(sb->snap_page);
+}
+
+// finds the snapshot with the given id
+snapshot*
+snapshot_get(int id)
+{
+    snapshot* table = snapshot_table();
+    if(table == 0 || id <= 0) {
+        return 0;
+    }
+
+    for(int ii = 0; ii < SNAP_MAX; ++ii) {
+        if(table[ii].id == id) {
+            return &table[ii];
+        }
+    }
+    return 0;
+}
+
+// gets a snapshot's copy of the inode chunk index
+static
+int*
+snap_inode_chunks(snapshot* snap)
+{
+    char* page = pages_get_page(snap->meta);
+    return (int*)(page + inode_chunks_offset);
+}
+
+// gets inode inum out of a snapshot's copies of the inode chunks
+static
+inode*
+snap_inode(snapshot* snap, int inum)
+{
+    int chunk = snap_inode_chunks(snap)[inum / inodes_per_chunk];
+    inode* first = pages_get_page(chunk);
+    return first + (inum % inodes_per_chunk);
+}
+
+// gets a snapshot's copy of the inode bitmap
+static
+char*
+snap_inode_bitmap(snapshot* snap)
+{
+    char* page = pages_get_page(snap->meta);
+    return page + inode_bitmap_offset;
+}
+
+// makes a private copy of a page, returning the copy's page number
+static
+int
+copy_page(int pnum)
+{
+    int copy = alloc_page();
+    if(copy < 0) {
+        return copy;
+    }
+    memcpy(pages_get_page(copy), pages_get_page(pnum), page_size);
+    return copy;
+}
+
+// adds up the pages taking a snapshot would allocate for one inode
+static
+void
+count_copies(inode* node, int pnum, int kind, int index, void* arg)
+{
+    int* counts = arg;
+    int shared = (kind == INODE_PAGE_DATA) && !S_ISDIR(node->mode) &&
+                 page_refs(pnum) <= UINT8_MAX;
+    if(kind == INODE_PAGE_TAIL) {
+        // fragment pages are only copied once
+        counts[1 + pnum] = 1;
+    }
+    else if(!shared) {
+        counts[0] += 1;
+    }
+}
+
+// points a snapshot inode at copies of the pages only it should
+// see, sharing file data pages with the live filesystem
+static
+void
+snap_inode_copy(inode* node, int* frag_copy)
+{
+    if(node->flags & INODE_INLINE) {
+        return;
+    }
+
+    if(compress_active(node)) {
+        node->cmap = copy_page(node->cmap);
+        cluster* map = compress_map(node);
+        for(int ii = 0; ii < CLUSTERS_PER_MAP; ++ii) {
+            for(int jj = 0; jj < CLUSTER_PAGES; ++jj) {
+                int pnum = map[ii].pages[jj];
+                if(pnum && page_ref(pnum)) {
+                    map[ii].pages[jj] = copy_page(pnum);
+                }
+            }
+        }
+        return;
+    }
+
+    if(node->iptr) {
+        node->iptr = copy_page(node->iptr);
+    }
+
+    int npages = inode_num_pages(node);
+    for(int ii = 0; ii < npages; ++ii) {
+        int pnum = inode_get_pnum(node, ii);
+        if(pnum && (S_ISDIR(node->mode) || page_ref(pnum))) {
+            inode_set_pnum(node, ii, copy_page(pnum));
+        }
+    }
+
+    if(node->flags & INODE_TAIL) {
+        if(frag_copy[node->tail_page] == 0) {
+            frag_copy[node->tail_page] = copy_page(node->tail_page);
+        }
+        node->tail_page = frag_copy[node->tail_page];
+    }
+}
+
+// takes a snapshot of the filesystem, returning its id
+int
+snapshot_create()
+{
+    superblock* sb = get_superblock();
+    char* ibm = get_inode_bitmap();
+
+    // work out how many pages the copies need up front, so running
+    // out of space can't leave a half taken snapshot behind
+    int counts[1 + num_pages];
+    memset(counts, 0, sizeof(counts));
+    for(int ii = 0; ii < num_inodes; ++ii) {
+        if(bitmap_get(ibm, ii)) {
+            inode_for_each_page(get_inode(ii), count_copies, counts);
+        }
+    }
+    int needed = 1 + sb->inode_chunks + counts[0] + (sb->snap_page == 0);
+    for(int ii = 0; ii < num_pages; ++ii) {
+        needed += counts[1 + ii];
+    }
+    if(needed > pages_free_count()) {
+        return -ENOSPC;
+    }
+
+    if(sb->snap_page == 0) {
+        int page = alloc_page();
+        memset(pages_get_page(page), 0, page_size);
+        sb->snap_page = page;
+    }
+
+    // find a free slot and the next id to hand out
+    snapshot* table = snapshot_table();
+    snapshot* snap = 0;
+    int id = 1;
+    for(int ii = 0; ii < SNAP_MAX; ++ii) {
+        if(table[ii].id == 0 && snap == 0) {
+            snap = &table[ii];
+        }
+        if(table[ii].id >= id) {
+            id = table[ii].id + 1;
+        }
+    }
+    if(snap == 0) {
+        return -EMLINK;
+    }
+
+    snap->meta = copy_page(0);
+    int* chunks = snap_inode_chunks(snap);
+    for(int ii = 0; ii < num_inode_chunks; ++ii) {
+        if(chunks[ii]) {
+            chunks[ii] = copy_page(chunks[ii]);
+        }
+    }
+
+    int frag_copy[num_pages];
+    memset(frag_copy, 0, sizeof(frag_copy));
+    for(int ii = 0; ii < num_inodes; ++ii) {
+        if(bitmap_get(ibm, ii)) {
+            snap_inode_copy(snap_inode(snap, ii), frag_copy);
+        }
+    }
+
+    struct timespec ts;
+    clock_gettime(CLOCK_REALTIME, &ts);
+    snap->time = ts.tv_sec;
+    snap->id = id;
+    printf("+ snapshot_create() -> %d, %d pages\n", id, needed);
+    return id;
+}
+
+// drops a snapshot's reference to a page, fragment pages are shared
+// by many inodes but were only copied once
+static
+void
+release_page(inode* node, int pnum, int kind, int index, void* arg)
+{
+    char* frag_seen = arg;
+    if(kind == INODE_PAGE_TAIL) {
+        if(frag_seen[pnum]) {
+            return;
+        }
+        frag_seen[pnum] = 1;
+    }
+    free_page(pnum);
+}
+
+// deletes a snapshot, giving back every page only it was using
+int
+snapshot_delete(int id)
+{
+    snapshot* snap = snapshot_get(id);
+    if(snap == 0) {
+        return -ENOENT;
+    }
+
+    char frag_seen[num_pages];
+    memset(frag_seen, 0, sizeof(frag_seen));
+    char* ibm = snap_inode_bitmap(snap);
+    for(int ii = 0; ii < num_inodes; ++ii) {
+        if(bitmap_get(ibm, ii)) {
+            inode_for_each_page(snap_inode(snap, ii), release_page, frag_seen);
+        }
+    }
+
+    int* chunks = snap_inode_chunks(snap);
+    for(int ii = 0; ii < num_inode_chunks; ++ii) {
+        if(chunks[ii]) {
+            free_page(chunks[ii]);
+        }
+    }
+    free_page(snap->meta);
+
+    printf("+ snapshot_delete(%d)\n", id);
+    memset(snap, 0, sizeof(snapshot));
+    return 0;
+}
+
+// makes everything read through the storage layer see the snapshot
+// instead of the live filesystem
+int
+snapshot_open(int id)
+{
+    snapshot* snap = snapshot_get(id);
+    if(snap == 0) {
+        return -ENOENT;
+    }
+
+    pages_set_view(snap->meta);
+    return 0;
+}
@@ -0,0 +1,22 @@
+#ifndef SNAPSHOT_H
+#define SNAPSHOT_H
+
+#include <time.h>
+
+// a snapshot keeps its own copy of page 0, whose inode chunk index
+// points at its own copies of the inode chunks
+#define SNAP_MAX 16
+
+typedef struct snapshot {
+    int id; // 0 if this slot is unused
+    time_t time; // when it was taken
+    int meta; // copy of page 0
+} snapshot;
+
+int snapshot_create();
+int snapshot_delete(int id);
+snapshot* snapshot_get(int id);
+snapshot* snapshot_table();
+int snapshot_open(int id);
+
+#endif
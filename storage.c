@@ -4,12 +4,27 @@
 #include <errno.h>
 #include <string.h>
 #include <time.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <limits.h>
+#include <linux/fs.h>
 
 #include "storage.h"
 #include "sizes.h"
 #include "directory.h"
+#include "snapshot.h"
+#include "dedup.h"
+#include "compress.h"
+#include "defrag.h"
+#include "bitmap.h"
 #include "util.h"
+#include "uring.h"
 
+// set when looking at a snapshot, nothing may be written
+static int storage_readonly = 0;
+
+// STORAGE_* flags given to storage_init
+static int storage_flags = 0;
 
 // gets the inode corresponding to path and fills in
 // the inode number pointed to by inum (if not NULL) and
@@ -41,12 +56,42 @@ path_get_inode(const char* path, int* inum, inode** ptr)
     return 0;
 }
 
-// init storage
+// init storage, looking at snapshot id instead of the live
+// filesystem if it isn't 0
+void
+storage_init(const char* path, int snapshot, int flags)
+{
+    storage_flags = flags;
+
+    int policy = 0;
+    policy |= (flags & STORAGE_POPULATE) ? PAGES_POPULATE : 0;
+    policy |= (flags & STORAGE_MLOCK) ? PAGES_MLOCK : 0;
+    policy |= (flags & STORAGE_HUGEPAGE) ? PAGES_HUGEPAGE : 0;
+    policy |= (flags & STORAGE_ADVISE) ? PAGES_ADVISE : 0;
+    pages_set_policy(policy);
+    pages_set_backend((flags & STORAGE_URING) ? &uring_backend : 0);
+    if(snapshot == 0) {
+        pages_init(path, 0);
+        directory_init();
+        return;
+    }
+
+    pages_init(path, 1);
+    storage_begin();
+    int rv = snapshot_open(snapshot);
+    storage_end(rv);
+    if(rv) {
+        fprintf(stderr, "nufs: no snapshot %d in %s\n", snapshot, path);
+        exit(1);
+    }
+    storage_readonly = 1;
+}
+
+// turns off storage_init flags that turned out not to be usable
 void
-storage_init(const char* path)
+storage_drop_flags(int flags)
 {
-    pages_init(path);
-    directory_init();
+    storage_flags &= ~flags;
 }
 
 // get inode status information
@@ -90,32 +135,17 @@ read_page(char* page, char* buf, int start, int length)
     return read_bytes;
 }
 
-// read from the specified file starting at offset, a number of bytes
+// reads from an inode starting at offset, a number of bytes
 // size or until the file is done 
+static
 int
-storage_read(const char* path, char* buf, size_t size, off_t offset)
+node_read(inode* node, char* buf, size_t size, off_t offset)
 {
-    int rv;
-    inode* node = 0;
-    if((rv = path_get_inode(path, 0, &node))) {
-        return rv;
-    }
-
-    // if this is a directory is cannot be read from
-    if(S_ISDIR(node->mode)) {
-        return -EISDIR;
-    }
-
     // check that offset is inside file contents
     if(offset >= node->size) {
         return 0;
     }
 
-    // update access time
-    struct timespec ts;
-    clock_gettime(CLOCK_REALTIME, &ts);
-    node->atime = ts.tv_sec;
-    
     // in order to do the read a few things are tracked
     // 1. current page being read from
     // 2. bytes read
@@ -130,6 +160,21 @@ storage_read(const char* path, char* buf, size_t size, off_t offset)
         bytes_left = node->size - offset;
     }
 
+    if(compress_active(node)) {
+        return compress_read(node, buf, bytes_left, offset);
+    }
+
+    // let the kernel read the pages in together rather than fault
+    // on each one in turn
+    int last = min((offset + bytes_left - 1) / page_size, inode_num_pages(node) - 1);
+    if(last > page_index) {
+        int pnums[last - page_index + 1];
+        for(int ii = page_index; ii <= last; ++ii) {
+            pnums[ii - page_index] = inode_get_pnum(node, ii);
+        }
+        pages_advise_read(pnums, last - page_index + 1);
+    }
+
     int bytes_read = 0;
     int page_offset = offset % page_size;
     char* page = 0;
@@ -151,6 +196,55 @@ storage_read(const char* path, char* buf, size_t size, off_t offset)
     return bytes_read; 
 }
 
+// updates the access time of a file being read. unless mounted with
+// STORAGE_STRICTATIME this is relatime, only the first read after the
+// file changed or one a day later does it, so reading the same files
+// over and over doesn't keep rewriting the inode table
+static
+void
+touch_atime(inode* node)
+{
+    if(storage_flags & STORAGE_NOATIME) {
+        return;
+    }
+
+    struct timespec ts;
+    clock_gettime(CLOCK_REALTIME_COARSE, &ts);
+    if(!(storage_flags & STORAGE_STRICTATIME) && node->atime > node->mtime &&
+       ts.tv_sec - node->atime < 24 * 60 * 60) {
+        return;
+    }
+    node->atime = ts.tv_sec;
+}
+
+// read from the specified file starting at offset, a number of bytes
+// size or until the file is done 
+int
+storage_read(const char* path, char* buf, size_t size, off_t offset)
+{
+    int rv;
+    inode* node = 0;
+    if((rv = path_get_inode(path, 0, &node))) {
+        return rv;
+    }
+
+    // if this is a directory is cannot be read from
+    if(S_ISDIR(node->mode)) {
+        return -EISDIR;
+    }
+
+    // check that offset is inside file contents
+    if(offset >= node->size) {
+        return 0;
+    }
+
+    if(!storage_readonly) {
+        touch_atime(node);
+    }
+
+    return node_read(node, buf, size, offset);
+}
+
 // writes to a given page starting at index start into a given
 // buffer of size length until either the buffer used or the 
 // page ends returning the number of bytes written 
@@ -170,42 +264,34 @@ write_page(char* page, char* buf, int start, int length)
 }
 
 
-// writes data in buf of length size, into a storage object at path
-// starting at offset bytes in the file 
+// writes data in buf of length size, into inode inum starting at
+// offset bytes in the file
+static
 int
-storage_write(const char* path, const char* buf, size_t size, off_t offset)
+node_write(inode* node, int inum, const char* buf, size_t size, off_t offset)
 {
+    // try to grow node to needed size, anything between the old end
+    // of the file and offset reads back as zeros
     int rv;
-    inode* node = 0;
-    if((rv = path_get_inode(path, 0, &node))) {
-        return rv;
-    }
-
-    // if this is a directory is cannot be read from
-    if(S_ISDIR(node->mode)) {
-        return -EISDIR;
-    }
-
-    // check that offset is allowed 
-    if(offset > node->size) {
-        rv = storage_truncate(path, offset);
+    if((offset + size) > node->size) {
+        rv = grow_inode(node, inum, offset+size - node->size);
         if(rv) {
             return rv;
         }
     }
 
-    // try to grow node to needed size
-    if((offset + size) > node->size) {
-        rv = grow_inode(node, offset+size - node->size);
-        if(rv) {
-            return rv;
-        }
+    // update modification time. a kernel caching writes sends its own
+    // with a setattr, and a write it flushes later mustn't undo one an
+    // application set in between
+    if(!(storage_flags & STORAGE_WRITEBACK)) {
+        struct timespec ts;
+        clock_gettime(CLOCK_REALTIME, &ts);
+        node->mtime = ts.tv_sec;
     }
 
-    // update modification time
-    struct timespec ts;
-    clock_gettime(CLOCK_REALTIME, &ts);
-    node->mtime = ts.tv_sec;
+    if(compress_active(node)) {
+        return compress_write(node, buf, size, offset);
+    }
 
     // now just need to write buffer contents to file
     int page_index = offset / page_size;
@@ -214,10 +300,10 @@ storage_write(const char* path, const char* buf, size_t size, off_t offset)
     int write_bytes = 0;
     char* page = 0;
     while(bytes_left > 0) {
-        page = inode_get_page(node, page_index++);
+        page = inode_get_page_writable(node, page_index++);
         if(page == 0) {
             printf("bad write page\n");
-            return 0;
+            return write_bytes ? write_bytes : -ENOSPC;
         }
 
         int bytes = write_page(page, (char*)(buf + write_bytes), page_offset, bytes_left);
@@ -227,24 +313,58 @@ storage_write(const char* path, const char* buf, size_t size, off_t offset)
         // after first page, writing is aligned
         page_offset = 0;
     }
+
+    // share any full page this write left identical to another one
+    if((storage_flags & STORAGE_DEDUP) && S_ISREG(node->mode)) {
+        int last = min((offset + write_bytes - 1) / page_size,
+                       node->size / page_size - 1);
+        for(int ii = offset / page_size; ii <= last; ++ii) {
+            dedup_page(node, ii);
+        }
+    }
     
     return write_bytes;
 }
 
+// writes data in buf of length size, into a storage object at path
+// starting at offset bytes in the file 
+int
+storage_write(const char* path, const char* buf, size_t size, off_t offset)
+{
+    int rv;
+    int inum;
+    inode* node = 0;
+    if((rv = path_get_inode(path, &inum, &node))) {
+        return rv;
+    }
+
+    // if this is a directory is cannot be read from
+    if(S_ISDIR(node->mode)) {
+        return -EISDIR;
+    }
+
+    return node_write(node, inum, buf, size, offset);
+}
+
 // sets the size of a file to size, appending /000 if necessary
 int
 storage_truncate(const char *path, off_t size)
 {
     inode* node;
-    int rv = path_get_inode(path, 0, &node);
+    int inum;
+    int rv = path_get_inode(path, &inum, &node);
     if(rv) {
         return rv;
     }
     
     if(size > node->size) {
-        return grow_inode(node, size - node->size);
+        return grow_inode(node, inum, size - node->size);
     }
     else if(size < node->size) {
+        // emptying a large file leaves freeing its pages to the reclaimer
+        if(size == 0 && inode_detach(inum) == 0) {
+            return 0;
+        }
         return shrink_inode(node, node->size - size);
     }
     return 0;
@@ -261,6 +381,52 @@ get_parent_dir(const char* path, char* buf, int length)
 }
 
 
+// returns 0 if name isn't in directory dd yet, -EEXIST if it is, or
+// -EIO if the directory can't be read to tell
+static
+int
+name_unused(inode* dd, const char* name)
+{
+    int rv = directory_lookup(dd, name);
+    if(rv >= 0) {
+        return -EEXIST;
+    }
+    return rv == -ENOENT ? 0 : rv;
+}
+
+// creates an inode of mode as name in directory dir_inum, returning
+// its number. the name is expected not to be there already
+static
+int
+dir_mknod(int dir_inum, inode* dir_node, const char* name, int mode)
+{
+    // allocate a new inode, near its directory
+    int new_inode = alloc_inode(dir_inum, mode);
+    if(new_inode < 0) {
+        return new_inode;
+    }
+
+    inode* new_node = get_inode(new_inode);
+    if(new_node == 0) {
+        return -EIO;
+    }
+    new_node->mode = mode;
+
+    // files made in a compressed directory are compressed too
+    if(dir_node->flags & INODE_COMPRESS) {
+        new_node->flags |= INODE_COMPRESS;
+    }
+    
+    // add it to the directory
+    printf("adding %s, %d to %d\n", name, new_inode, dir_inum);
+    int rv = directory_put(dir_node, name, new_inode);
+    if(rv) {
+        free_inode(new_inode);
+        return rv;
+    }
+    return new_inode;
+}
+
 // create an inode storage object at path with mode
 int
 storage_mknod(const char* path, int mode)
@@ -276,35 +442,112 @@ storage_mknod(const char* path, int mode)
     printf("mknod path %s -> dir %s\n", path, dir);
 
     // find the inode of the directory
+    int dir_inum;
     inode* dir_node;
-    int rv = path_get_inode(dir, 0, &dir_node);
+    int rv = path_get_inode(dir, &dir_inum, &dir_node);
     if(rv) {
         return rv;
     }
 
-    // allocate a new inode
-    int new_inode = alloc_inode();
-    if(new_inode < 0) {
-        return new_inode;
+    // check if this name already exists in the directory
+    char* name = (char*)path + path_file_index(path);
+    if((rv = name_unused(dir_node, name))) {
+        return rv;
     }
 
-    inode* new_node = get_inode(new_inode);
-    if(new_inode == 0) {
-        return -EIO;
+    rv = dir_mknod(dir_inum, dir_node, name, mode);
+    return rv < 0 ? rv : 0;
+}
+
+// creates one record of a batch in directory dir_inum, returning the
+// bytes it took up in the batch
+static
+int
+create_one(int dir_inum, inode* dir_node, const char* rec_buf, int left)
+{
+    struct nufs_create_rec rec;
+    if(left < (int)sizeof(rec)) {
+        return -EINVAL;
     }
-    new_node->mode = mode;
-    char* name = (char*)path + path_file_index(path);
-    
-    // check if this name already exists in the directory
-    if(directory_lookup(dir_node, name) >= 0) {
-        return -EEXIST;
+    memcpy(&rec, rec_buf, sizeof(rec));
+    int len = sizeof(rec) + rec.name_len + rec.size;
+    if(rec.name_len == 0 || rec.name_len > DIR_NAME || rec.size > left || len > left) {
+        return -EINVAL;
     }
-    
-    // add it to the directory
-    printf("adding %s, %d to %s\n", name, new_inode, dir);
-    return directory_put(dir_node, name, new_inode);
+
+    char name[DIR_NAME + 1];
+    memcpy(name, rec_buf + sizeof(rec), rec.name_len);
+    name[rec.name_len] = 0;
+    if(strlen(name) != rec.name_len || strchr(name, '/') || streq(name, ".") || streq(name, "..")) {
+        return -EINVAL;
+    }
+    if(!S_ISREG(rec.mode) && !S_ISLNK(rec.mode) && !S_ISDIR(rec.mode)) {
+        return -EINVAL;
+    }
+    if(S_ISDIR(rec.mode) && rec.size) {
+        return -EISDIR;
+    }
+    int rv = name_unused(dir_node, name);
+    if(rv) {
+        return rv;
+    }
+
+    int inum = dir_mknod(dir_inum, dir_node, name, rec.mode);
+    if(inum < 0) {
+        return inum;
+    }
+    inode* node = get_inode(inum);
+    if(rec.size) {
+        // a short write would leave a truncated file or symlink target
+        rv = node_write(node, inum, rec_buf + sizeof(rec) + rec.name_len, rec.size, 0);
+        if(rv != (int)rec.size) {
+            directory_delete(dir_node, name);
+            return rv < 0 ? rv : -ENOSPC;
+        }
+    }
+    node->mtime = rec.mtime;
+    return (len + 7) & ~7;
 }
 
+// creates the files packed in batch in the directory at path, which
+// is only looked up once for all of them. stops at the first one that
+// fails, returning its error if nothing was created, otherwise batch
+// count is set to how many were
+int
+storage_create_many(const char* path, struct nufs_create* batch)
+{
+    if(storage_readonly) {
+        return -EROFS;
+    }
+
+    int dir_inum;
+    inode* dir_node;
+    int rv = path_get_inode(path, &dir_inum, &dir_node);
+    if(rv) {
+        return rv;
+    }
+    if(!S_ISDIR(dir_node->mode)) {
+        return -ENOTDIR;
+    }
+
+    int used = min(batch->used, NUFS_CREATE_BUF);
+    int offset = 0;
+    int made = 0;
+    while(made < batch->count) {
+        rv = create_one(dir_inum, dir_node, batch->buf + offset, used - offset);
+        if(rv < 0) {
+            break;
+        }
+        offset += rv;
+        made += 1;
+    }
+
+    if(made == 0 && batch->count > 0) {
+        return rv;
+    }
+    batch->count = made;
+    return 0;
+}
 
 // unlinks a reference to path removing the directory reference
 // and the underlying file if this was the last reference to it
@@ -350,6 +593,9 @@ storage_link(const char *from, const char *to)
     if(rv) {
         return rv;
     }
+    if((rv = name_unused(to_dir, to + path_file_index(to)))) {
+        return rv;
+    }
 
     return directory_put(to_dir, to + path_file_index(to), from_inode);
 }
@@ -370,37 +616,490 @@ storage_rename(const char *from, const char *to)
     printf("from dir %s, file %s\n", from_dir, from_file);
     printf("to dir %s, file %s\n", to_dir, to_file);
 
-    // get inodes for both parent directories
+    // a directory can't be moved inside of itself
+    int from_len = strlen(from);
+    if(strncmp(from, to, from_len) == 0 && to[from_len] == '/') {
+        return -EINVAL;
+    }
+
+    // get inodes for both parent directories, only walking the
+    // tree once when they are the same
     inode* from_dir_node, *to_dir_node;
     int rv = path_get_inode(from_dir, 0, &from_dir_node);
     if(rv) {
         return rv;
     }
-    rv = path_get_inode(to_dir, 0 , &to_dir_node);
+    if(streq(from_dir, to_dir)) {
+        to_dir_node = from_dir_node;
+    }
+    else {
+        rv = path_get_inode(to_dir, 0 , &to_dir_node);
+        if(rv) {
+            return rv;
+        }
+    }
+
+    return directory_rename(from_dir_node, from_file, to_dir_node, to_file);
+}
+
+
+// whether bytes of data are all zeros
+static
+int
+all_zero(const char* data, int bytes)
+{
+    for(int ii = 0; ii < bytes; ++ii) {
+        if(data[ii]) {
+            return 0;
+        }
+    }
+    return 1;
+}
+
+// copies bytes (at most up to the end of a page of src) from src at
+// from_offset to dst, number dst_inum, at to_offset. an aligned full page is shared
+// rather than copied when it can be, and a data page of src is
+// written straight out of its page without a copy in between. zeros
+// landing past old_size, where dst has just grown, aren't written
+// at all, they are zeros already
+static
+int
+copy_bytes(inode* src, off_t from_offset, inode* dst, int dst_inum,
+           off_t to_offset, int bytes, off_t old_size)
+{
+    int src_index = from_offset / page_size;
+    int dst_index = to_offset / page_size;
+    if(bytes == page_size && (from_offset % page_size) == 0 && (to_offset % page_size) == 0 &&
+       inode_clone_page(dst, dst_inum, dst_index, src, src_index) == 0) {
+        return 0;
+    }
+
+    // pages of packed tails, inline contents and compressed clusters
+    // might move while dst is written to, those go through a buffer
+    char page[page_size];
+    const char* data = page;
+    if(!compress_active(src) && src_index < inode_num_pages(src)) {
+        data = (char*)inode_get_page(src, src_index) + (from_offset % page_size);
+    }
+    else {
+        node_read(src, page, bytes, from_offset);
+    }
+
+    if(to_offset >= old_size && all_zero(data, bytes)) {
+        off_t end = to_offset + bytes;
+        return end > dst->size ? grow_inode(dst, dst_inum, end - dst->size) : 0;
+    }
+    int rv = node_write(dst, dst_inum, data, bytes, to_offset);
+    return rv < 0 ? rv : 0;
+}
+
+// looks up the two regular files a clone goes between, which have to
+// be different files
+static
+int
+clone_inodes(const char* from, const char* to, inode** src, inode** dst, int* dst_inum)
+{
+    int src_inum;
+    int rv = path_get_inode(from, &src_inum, src);
+    if(rv) {
+        return rv;
+    }
+    rv = path_get_inode(to, dst_inum, dst);
     if(rv) {
         return rv;
     }
 
-    // also need to get information on the inode being moved
-    int move_inode;
-    inode* move_node;
-    rv = path_get_inode(from, &move_inode, &move_node);
+    if(!S_ISREG((*src)->mode) || !S_ISREG((*dst)->mode)) {
+        return S_ISDIR((*src)->mode) || S_ISDIR((*dst)->mode) ? -EISDIR : -EINVAL;
+    }
+    if(src_inum == *dst_inum) {
+        return -EINVAL;
+    }
+    return 0;
+}
+
+// pages cloning all of src into an emptied dst takes at worst: a copy
+// of every full page that can't be shared, the tail, an indirect
+// pointer page or cluster map, and an inode chunk for emptying dst
+static
+int
+clone_pages_needed(inode* src, inode* dst)
+{
+    int share = !(src->flags & INODE_INLINE) && !compress_active(src) &&
+                !(dst->flags & INODE_COMPRESS);
+    int full = src->size / page_size;
+    int needed = 3;
+    for(int ii = 0; ii < full; ++ii) {
+        if(!share || page_refs(inode_get_pnum(src, ii)) > UINT8_MAX) {
+            needed += 1;
+        }
+    }
+    return needed;
+}
+
+// replaces the contents of 'to' with a clone of all of 'from'. every
+// check is made before 'to' is emptied, so an error leaves it alone
+int
+storage_clone_file(const char* from, const char* to)
+{
+    inode* src, *dst;
+    int dst_inum;
+    int rv = clone_inodes(from, to, &src, &dst, &dst_inum);
     if(rv) {
         return rv;
     }
+    if(clone_pages_needed(src, dst) > get_superblock()->free_pages) {
+        return -ENOSPC;
+    }
 
-    // if 'to' already exists, delete it
-    directory_delete(to_dir_node, to_file);
+    rv = storage_truncate(to, 0);
+    if(rv) {
+        return rv;
+    }
+    return storage_clone(from, to, 0, 0, 0);
+}
 
-    // now that we have both directories, delete from, add to
-    rv = directory_put(to_dir_node, to_file, move_inode);
+// makes the length bytes of 'to' starting at to_offset share the
+// data pages of 'from' starting at from_offset, copying anything that
+// isn't a full page. a length of 0 clones the rest of 'from'
+int
+storage_clone(const char* from, const char* to, off_t from_offset,
+              off_t length, off_t to_offset)
+{
+    inode* src, *dst;
+    int dst_inum;
+    int rv = clone_inodes(from, to, &src, &dst, &dst_inum);
     if(rv) {
         return rv;
     }
 
-    return directory_delete(from_dir_node, from_file);
+    // like the kernel, only whole pages can be cloned except for a
+    // range running up to the end of the source
+    if(length == 0) {
+        length = src->size - from_offset;
+    }
+    if(from_offset < 0 || to_offset < 0 || length < 0 ||
+       from_offset + length > src->size ||
+       (from_offset % page_size) || (to_offset % page_size) ||
+       ((length % page_size) && from_offset + length != src->size)) {
+        return -EINVAL;
+    }
+
+    for(off_t pos = 0; pos < length; pos += page_size) {
+        int bytes = min(page_size, length - pos);
+        rv = copy_bytes(src, from_offset + pos, dst, dst_inum, to_offset + pos, bytes, dst->size);
+        if(rv) {
+            return rv;
+        }
+    }
+
+    struct timespec ts;
+    clock_gettime(CLOCK_REALTIME, &ts);
+    dst->mtime = ts.tv_sec;
+    return 0;
 }
 
+// copies up to size bytes of 'from' starting at from_offset into 'to'
+// at to_offset without them ever leaving the image, sharing whole
+// pages where both offsets line up. returns the bytes copied
+int
+storage_copy_range(const char* from, off_t from_offset, const char* to,
+                   off_t to_offset, size_t size)
+{
+    inode* src, *dst;
+    int src_inum, dst_inum;
+    int rv = path_get_inode(from, &src_inum, &src);
+    if(rv) {
+        return rv;
+    }
+    rv = path_get_inode(to, &dst_inum, &dst);
+    if(rv) {
+        return rv;
+    }
+
+    if(!S_ISREG(src->mode) || !S_ISREG(dst->mode)) {
+        return S_ISDIR(src->mode) || S_ISDIR(dst->mode) ? -EISDIR : -EINVAL;
+    }
+    if(from_offset < 0 || to_offset < 0) {
+        return -EINVAL;
+    }
+    if(from_offset >= src->size) {
+        return 0;
+    }
+    off_t length = src->size - from_offset;
+    if(size < length) {
+        length = size;
+    }
+    if(src_inum == dst_inum && from_offset < to_offset + length &&
+       to_offset < from_offset + length) {
+        return -EINVAL;
+    }
+
+    // a page of src at a time, so only the first and last can be partial
+    off_t old_size = dst->size;
+    off_t pos = 0;
+    while(pos < length) {
+        int bytes = min(page_size - (from_offset + pos) % page_size, length - pos);
+        rv = copy_bytes(src, from_offset + pos, dst, dst_inum, to_offset + pos, bytes, old_size);
+        if(rv) {
+            break;
+        }
+        pos += bytes;
+    }
+    if(pos == 0) {
+        return rv;
+    }
+
+    struct timespec ts;
+    clock_gettime(CLOCK_REALTIME, &ts);
+    dst->mtime = ts.tv_sec;
+    return pos;
+}
+
+// takes a snapshot of the whole filesystem, returning its id
+int
+storage_snapshot()
+{
+    if(storage_readonly) {
+        return -EROFS;
+    }
+
+    // a snapshot would hold on to the pages of files already deleted
+    inode_reclaim(INT_MAX);
+    return snapshot_create();
+}
+
+// deletes a snapshot
+int
+storage_snapshot_delete(int id)
+{
+    if(storage_readonly) {
+        return -EROFS;
+    }
+    return snapshot_delete(id);
+}
+
+// gets the FS_*_FL attribute flags of a storage object
+int
+storage_get_flags(const char* path, int* flags)
+{
+    inode* node;
+    int rv = path_get_inode(path, 0, &node);
+    if(rv) {
+        return rv;
+    }
+
+    *flags = (node->flags & INODE_COMPRESS) ? FS_COMPR_FL : 0;
+    return 0;
+}
+
+// counts the pages an inode is using
+static
+void
+count_pages(inode* node, int pnum, int kind, int index, void* arg)
+{
+    *(int*)arg += 1;
+}
+
+// counts the pages only this inode is using
+static
+void
+count_own_pages(inode* node, int pnum, int kind, int index, void* arg)
+{
+    if(kind != INODE_PAGE_TAIL && page_refs(pnum) == 1) {
+        *(int*)arg += 1;
+    }
+}
+
+// sets the FS_*_FL attribute flags of a storage object, a file
+// already holding data is rewritten to match
+int
+storage_set_flags(const char* path, int flags)
+{
+    inode* node;
+    int inum;
+    int rv = path_get_inode(path, &inum, &node);
+    if(rv) {
+        return rv;
+    }
+    if(flags & ~FS_COMPR_FL) {
+        return -EOPNOTSUPP;
+    }
+    if(storage_readonly) {
+        return -EROFS;
+    }
+
+    int compress = (flags & FS_COMPR_FL) ? INODE_COMPRESS : 0;
+    if((node->flags & INODE_COMPRESS) == compress) {
+        return 0;
+    }
+    if(!S_ISREG(node->mode) || node->size == 0 || (node->flags & INODE_INLINE)) {
+        node->flags ^= INODE_COMPRESS;
+        return 0;
+    }
+
+    // the data is written back after the old pages are let go, check
+    // there will be room for it in the worst case first
+    int own = 0;
+    inode_for_each_page(node, count_own_pages, &own);
+    int size = node->size;
+    if(pages_free_count() + own < bytes_to_pages(size) + 1) {
+        return -ENOSPC;
+    }
+
+    char* data = malloc(size);
+    if(data == 0) {
+        return -ENOMEM;
+    }
+    rv = node_read(node, data, size, 0);
+    rv = (rv == size) ? shrink_inode(node, size) : -EIO;
+    if(!rv) {
+        node->flags ^= INODE_COMPRESS;
+        rv = node_write(node, inum, data, size, 0);
+        rv = (rv == size) ? 0 : (rv < 0 ? rv : -EIO);
+    }
+    free(data);
+    return rv;
+}
+
+// dedups every file, returning the number of pages freed
+int
+storage_dedup()
+{
+    if(storage_readonly) {
+        return -EROFS;
+    }
+    return dedup_all();
+}
+
+// moves the pages of the file at path into one run, or with the
+// root compacts the whole image. returns the number of pages moved
+int
+storage_defrag(const char* path)
+{
+    inode* node;
+    int rv = path_get_inode(path, 0, &node);
+    if(rv) {
+        return rv;
+    }
+    if(storage_readonly) {
+        return -EROFS;
+    }
+
+    if(streq(path, "/")) {
+        return defrag_all();
+    }
+    return defrag_inode(node, 0);
+}
+
+// fills in the free space and inodes for statfs, straight from the
+// counts in the superblock. inodes past the chunks already allocated
+// need a free page for their chunk
+int
+storage_statfs(struct statvfs* st)
+{
+    superblock* sb = get_superblock();
+    int used = num_inodes - sb->free_inodes;
+    int free_inodes = sb->inode_chunks * inodes_per_chunk - used +
+                      sb->free_pages * inodes_per_chunk;
+    free_inodes = min(free_inodes, sb->free_inodes);
+    memset(st, 0, sizeof(struct statvfs));
+    st->f_bsize = page_size;
+    st->f_frsize = page_size;
+    st->f_blocks = num_pages;
+    st->f_bfree = sb->free_pages;
+    st->f_bavail = sb->free_pages;
+    st->f_files = num_inodes;
+    st->f_ffree = free_inodes;
+    st->f_favail = free_inodes;
+    st->f_namemax = DIR_NAME;
+    if(storage_readonly) {
+        st->f_flag |= ST_RDONLY;
+    }
+    return 0;
+}
+
+// fills in how the image's pages are being used
+int
+storage_stats(struct nufs_stats* stats)
+{
+    void* pbm = get_pages_bitmap();
+    memset(stats, 0, sizeof(struct nufs_stats));
+    stats->pages_total = num_pages;
+    for(int ii = 0; ii < num_pages; ++ii) {
+        if(bitmap_get(pbm, ii)) {
+            stats->pages_shared += page_refs(ii) - 1;
+        }
+        else {
+            stats->pages_free += 1;
+        }
+    }
+    stats->dedup_merged = get_superblock()->dedup_merged;
+
+    pages_health health;
+    pages_get_health(&health);
+    stats->csum_errors = health.csum_errors;
+    stats->bad_pages = health.bad_pages;
+    stats->scrub_passes = health.scrub_passes;
+    stats->scrub_pages = health.scrub_pages;
+
+    char* ibm = get_inode_bitmap();
+    for(int ii = 0; ii < num_inodes; ++ii) {
+        inode* node = bitmap_get(ibm, ii) ? get_inode(ii) : 0;
+        if(node && compress_active(node)) {
+            int stored = 0;
+            inode_for_each_page(node, count_pages, &stored);
+            stats->compress_raw += bytes_to_pages(node->size);
+            stats->compress_stored += stored;
+        }
+    }
+    return 0;
+}
+
+// every storage operation has to be made between storage_begin
+// and storage_end, one at a time
+void
+storage_begin()
+{
+    pages_begin();
+}
+
+// finishes an operation, turning its result into an I/O error if
+// anything it looked at didn't match its checksum
+int
+storage_end(int rv)
+{
+    int errors = pages_end();
+    if(errors && rv >= 0) {
+        return -EIO;
+    }
+    return rv;
+}
+
+// checks the next count pages against their checksums, returning
+// how many pages are known to be bad
+int
+storage_scrub(int count)
+{
+    pages_health health;
+    storage_begin();
+    pages_scrub(count);
+    pages_end();
+    pages_get_health(&health);
+    return health.bad_pages;
+}
+
+// frees up to count pages of deleted files, returning how many of
+// them are still waiting
+int
+storage_reclaim(int count)
+{
+    if(storage_readonly) {
+        return 0;
+    }
+    storage_begin();
+    return storage_end(inode_reclaim(count));
+}
 
 // sets a new access and modification time for a storage object 
 int
@@ -416,9 +1115,48 @@ storage_set_time(const char* path, const struct timespec ts[2])
         return -ENOENT;
     }
 
-    node->mtime = ts[0].tv_sec;
-    node->atime = ts[1].tv_sec;
+    // the access time comes first, either can be left alone or set
+    // to now
+    struct timespec now;
+    clock_gettime(CLOCK_REALTIME, &now);
+    if(ts[0].tv_nsec != UTIME_OMIT) {
+        node->atime = ts[0].tv_nsec == UTIME_NOW ? now.tv_sec : ts[0].tv_sec;
+    }
+    if(ts[1].tv_nsec != UTIME_OMIT) {
+        node->mtime = ts[1].tv_nsec == UTIME_NOW ? now.tv_sec : ts[1].tv_sec;
+    }
+
+    return 0;
+}
+
+// a file has been opened, writing says whether it can be written.
+// returns the inode number to close it by, which keeps working after
+// the name is gone
+int
+storage_open(const char* path, int writing)
+{
+    int inum;
+    int rv = path_get_inode(path, &inum, 0);
+    if(rv) {
+        return rv;
+    }
+    if(writing) {
+        inode_open_writer(inum);
+    }
+    return inum;
+}
 
+// the file inum opened with storage_open has been closed. readers
+// coming and going leave a writer's window alone
+int
+storage_release(int inum, int writing)
+{
+    if(inum < 0 || inum >= num_inodes) {
+        return -EBADF;
+    }
+    if(writing) {
+        inode_close_writer(inum);
+    }
     return 0;
 }
 
@@ -459,20 +1197,20 @@ storage_chmod(const char* path, mode_t mode)
 }
 
 
-slist*
-storage_list(const char* path)
+// sets list to the names in the directory at path
+int
+storage_list(const char* path, slist** list)
 {
+    *list = 0;
     inode* node;
     int rv = path_get_inode(path, 0, &node);
     if(rv) {
-        return 0;
+        return rv;
     }
 
     if(!S_ISDIR(node->mode)) {
-        return 0;
-    }
-    else {
-        return directory_list(path);
+        return -ENOTDIR;
     }
+    return directory_list(path, list);
 }
 
@@ -6,24 +6,58 @@
 #include <unistd.h>
 #include <sys/types.h>
 #include <sys/stat.h>
+#include <sys/statvfs.h>
 #include <time.h>
 
 #include "slist.h"
 #include "inode.h"
+#include "nufs_ioctl.h"
 
-void   storage_init(const char* path);
+// storage_init flags
+#define STORAGE_DEDUP 0x1 // dedup full pages as they are written
+#define STORAGE_POPULATE 0x2 // fault the whole image in when mounting
+#define STORAGE_MLOCK 0x4 // keep the superblock and inode table in memory
+#define STORAGE_HUGEPAGE 0x8 // ask for huge pages for the data pages
+#define STORAGE_ADVISE 0x10 // tell the kernel about reads ahead of time
+#define STORAGE_URING 0x20 // cache pages ourselves, reading them with io_uring
+#define STORAGE_NOATIME 0x40 // never update access times on reads
+#define STORAGE_STRICTATIME 0x80 // update them on every read, not just relatime
+#define STORAGE_WRITEBACK 0x100 // the kernel caches writes and keeps mtimes itself
+
+void   storage_init(const char* path, int snapshot, int flags);
+void   storage_drop_flags(int flags);
 int    storage_stat(const char* path, struct stat* st);
 int    storage_read(const char* path, char* buf, size_t size, off_t offset);
 int    storage_write(const char* path, const char* buf, size_t size, off_t offset);
 int    storage_truncate(const char *path, off_t size);
+int    storage_open(const char* path, int writing);
+int    storage_release(int inum, int writing);
 int    storage_mknod(const char* path, int mode); 
+int    storage_create_many(const char* path, struct nufs_create* batch);
 int    storage_unlink(const char* path);
 int    storage_link(const char *from, const char *to);
 int    storage_rename(const char *from, const char *to);
+int    storage_clone(const char* from, const char* to, off_t from_offset,
+                     off_t length, off_t to_offset);
+int    storage_clone_file(const char* from, const char* to);
+int    storage_copy_range(const char* from, off_t from_offset, const char* to,
+                          off_t to_offset, size_t size);
+int    storage_snapshot();
+int    storage_snapshot_delete(int id);
+int    storage_get_flags(const char* path, int* flags);
+int    storage_set_flags(const char* path, int flags);
+int    storage_dedup();
+int    storage_defrag(const char* path);
+int    storage_stats(struct nufs_stats* stats);
+int    storage_statfs(struct statvfs* st);
+void   storage_begin();
+int    storage_end(int rv);
+int    storage_scrub(int count);
+int    storage_reclaim(int count);
 int    storage_set_time(const char* path, const struct timespec ts[2]);
 int    storage_symlink(const char* to, const char* from);
 int    storage_chmod(const char* path, mode_t mode);
-slist* storage_list(const char* path);
+int    storage_list(const char* path, slist** list);
 int    path_get_inode(const char* path, int* inum, inode** ptr);
 
 #endif
@@ -2,8 +2,9 @@
 use 5.16.0;
 use warnings FATAL => 'all';
 
-use Test::Simple tests => 28;
+use Test::Simple tests => 57;
 use IO::Handle;
+use Digest::MD5;
 
 sub mount {
     system("(make mount 2>&1) >> test.log &");
@@ -124,6 +125,20 @@ my $msg4 = read_text("abc.txt");
 say "# '$msg2' eq '$msg4'?";
 ok($msg2 eq $msg4, "Read back data after rename.");
 
+write_text("old.txt", "old contents");
+write_text("new.txt", "new contents");
+system("mv mnt/new.txt mnt/old.txt");
+ok(read_text("old.txt") eq "new contents" && !-e "mnt/new.txt",
+   "Rename replaces an existing file.");
+
+system("ln -s abc.txt mnt/sym.txt");
+my $target = readlink("mnt/sym.txt") // "";
+ok($target eq "abc.txt", "Read back symlink target.");
+
+my $long_name = ("abcdefghij" x 25) . ".txt";
+write_text($long_name, $msg2);
+ok(read_text($long_name) eq $msg2, "Read back file with a 254 character name.");
+
 say "#           == Less Basic Tests ==";
 
 system("ln mnt/abc.txt mnt/def.txt");
@@ -187,4 +202,234 @@ mount();
 my $mm = `ls mnt/numbers | wc -l`;
 ok($mm == 46, "deleted 4 files");
 
+# written out again rather than with cp, which would share the pages
+write_text("40k-copy.txt", $huge0);
+my $dd = `./nufs-dedup mnt`;
+my ($freed) = $dd =~ /freed:\s*(\d+)/;
+ok(defined($freed) && $freed >= 9, "dedup shared the pages of a copy");
+ok(read_text("40k-copy.txt") eq $huge0, "Read back deduped copy.");
+
+system("mkdir mnt/logs && chattr +c mnt/logs");
+write_text("logs/40k.txt", $huge0);
+ok(read_text("logs/40k.txt") eq $huge0, "Read back file in a compressed directory.");
+
+my $df = `./nufs-defrag mnt`;
+ok($df =~ /mnt: \d+ pages moved/ && read_text("40k.txt") eq $huge0,
+   "defrag keeps file contents");
+
+my $ss = `./nufs-dedup -s mnt`;
+ok($ss =~ /checksum errors: 0 /, "no checksum errors");
+
+# more files than the old fixed inode table could hold
+system("mkdir mnt/lots && cd mnt/lots && touch \$(seq -f 'f%g' 1 300)");
+my $lots = `ls mnt/lots | wc -l`;
+system("rm -rf mnt/lots");
+ok($lots == 300, "created 300 empty files");
+
+# two files appended to in turn, each should keep to its own pages,
+# even with something else reading them as they grow
+open(my $la, '>>', 'mnt/a.log');
+open(my $lb, '>>', 'mnt/b.log');
+for my $ii (1..8) {
+    syswrite($la, chr(64 + $ii) x 4096);
+    syswrite($lb, chr(96 + $ii) x 4096);
+    read_text("a.log");
+    read_text("b.log");
+}
+close($la);
+close($lb);
+
+# large files are freed in the background, shortly after they go
+sub free_pages {
+    my ($free) = split ' ', `stat -f -c '%f' mnt`;
+    return $free;
+}
+
+sub wait_free_pages {
+    my ($want) = @_;
+    for (1..30) {
+        return 1 if free_pages() >= $want;
+        select(undef, undef, undef, 0.1);
+    }
+    return 0;
+}
+
+my $free0 = free_pages();
+write_text("big.bin", "x" x 131072);
+my $free1 = free_pages();
+unlink("mnt/big.bin");
+ok($free1 <= $free0 - 32 && wait_free_pages($free0), "an unlinked large file's pages are freed");
+
+write_text("big.bin", "y" x 131072);
+truncate("mnt/big.bin", 0);
+ok(-e "mnt/big.bin" && !-s "mnt/big.bin" && wait_free_pages($free0 - 1),
+   "a large file truncated to nothing gives its pages back");
+unlink("mnt/big.bin");
+
+# cp copies with copy_file_range, which shares the full pages
+my $free2 = free_pages();
+system("cp mnt/40k.txt mnt/40k-cp.txt");
+ok(read_text("40k-cp.txt") eq $huge0 && free_pages() >= $free2 - 1,
+   "a copy inside the filesystem shares its pages");
+unlink("mnt/40k-cp.txt");
+
+# the kernel caches attributes, a write through one name has to
+# invalidate what it has for the others
+write_text("linked.txt", "one");
+link("mnt/linked.txt", "mnt/linked2.txt");
+my $before = -s "mnt/linked2.txt";
+open(my $lk, '>>', 'mnt/linked.txt');
+syswrite($lk, "two\n");
+close($lk);
+# invalidations are sent from a thread of their own, give it a moment,
+# far less than the minute the kernel would otherwise keep the size
+my $after = 0;
+for (1..30) {
+    $after = -s "mnt/linked2.txt";
+    last if $after == 8;
+    select(undef, undef, undef, 0.1);
+}
+ok($before == 4 && $after == 8 && read_text("linked2.txt") eq "one\ntwo",
+   "another name for a changed file isn't stale");
+# and the other way, the kernel only looked up the new name when linking
+open($lk, '>>', 'mnt/linked2.txt');
+syswrite($lk, "three\n");
+close($lk);
+my @old = ();
+for (1..30) {
+    @old = stat("mnt/linked.txt");
+    last if $old[7] == 14;
+    select(undef, undef, undef, 0.1);
+}
+ok($old[7] == 14 && $old[3] == 2 && read_text("linked.txt") eq "one\ntwo\nthree",
+   "the original name sees changes through the new one");
+unlink("mnt/linked.txt", "mnt/linked2.txt");
+
+sub image_digest {
+    open my $fh, "<", "data.nufs" or return "";
+    binmode $fh;
+    my $digest = Digest::MD5->new->addfile($fh)->hexdigest;
+    close $fh;
+    return $digest;
+}
+
+# relatime: only the first read after a change updates the access time,
+# rereading after that doesn't write anything
+write_text("atime.txt", "read me");
+utime(1000000000, 1000000000, "mnt/atime.txt");
+read_text("atime.txt");
+my $atime1 = (stat("mnt/atime.txt"))[8];
+my $image1 = image_digest();
+read_text("atime.txt") for 1..50;
+ok($atime1 > 1000000000 && (stat("mnt/atime.txt"))[8] == $atime1 && image_digest() eq $image1,
+   "rereading a file leaves its access time and the image alone");
+
+system("touch -a mnt/atime.txt");
+ok((stat("mnt/atime.txt"))[9] == 1000000000, "touch -a leaves the modification time alone");
+unlink("mnt/atime.txt");
+
+# lots of small appends, then cut back to the middle of a page
+open(my $sa, '>>', 'mnt/small.log');
+my $small = "";
+for my $ii (1..300) {
+    my $line = sprintf("%04d %s\n", $ii, chr(65 + $ii % 26) x 300);
+    syswrite($sa, $line);
+    $small .= $line;
+}
+close($sa);
+my $small_ok = read_text("small.log") eq substr($small, 0, -1);
+truncate("mnt/small.log", 50000);
+$small_ok &&= read_text_slice("small.log", 60000, 0) eq substr($small, 0, 50000);
+ok($small_ok, "small appends and a truncate keep the contents in order");
+unlink("mnt/small.log");
+
+# a small tree restored a directory at a time with batched creates
+system("rm -rf import.src && mkdir -p import.src/sub");
+for my $ii (1..40) {
+    open my $fh, ">", "import.src/f$ii" or die;
+    print $fh "file $ii " x $ii;
+    close $fh;
+}
+system("echo deeper > import.src/sub/g && ln -s f1 import.src/link");
+utime(1000000000, 1000000000, "import.src/f7");
+system("mkdir mnt/imported");
+my $im = `./nufs-import import.src mnt/imported`;
+ok($im =~ /43 files created in [1-3] batches/ &&
+   read_text("imported/f40") eq ("file 40 " x 40) =~ s/\s*$//r &&
+   read_text("imported/sub/g") eq "deeper" &&
+   readlink("mnt/imported/link") eq "f1" &&
+   (stat("mnt/imported/f7"))[9] == 1000000000,
+   "nufs-import restores a tree with batched creates");
+system("rm -rf import.src mnt/imported");
+
+# NUFS_IOC_CLONE of a file onto itself fails without emptying it
+write_text("self.txt", "keep me");
+open(my $sc, '+<', 'mnt/self.txt');
+my $sc_rv = ioctl($sc, 0x40044e01, pack("i", fileno($sc)));
+close($sc);
+ok(!$sc_rv && read_text("self.txt") eq "keep me", "cloning a file onto itself leaves it alone");
+unlink("mnt/self.txt");
+
+my ($bfree, $ffree) = split ' ', `stat -f -c '%f %d' mnt`;
+ok($bfree > 0 && $ffree > 0 && $ffree < 4096, "statfs reports free pages and inodes");
+
+unmount();
+
+system("./nufs-fsck data.nufs > /dev/null");
+ok($? == 0, "fsck finds nothing wrong");
+
+my $ii = `./nufs-inspect data.nufs`;
+ok($ii =~ /largest \d+ pages/ && $ii =~ /\s\/numbers\n/, "inspect reports free space and directories");
+
+my @dir_groups = grep { $_ > 0 } $ii =~ /^\s+\d+\s+\d+-\d+\s+\d+\s+\d+\s+(\d+)$/mg;
+ok(@dir_groups > 1, "directories are spread over the allocation groups");
+
+# the indirect pointer page can split a file in two, but no more
+my $ff = `./nufs-inspect -f data.nufs`;
+my @log_runs = map { scalar(() = /\d+-\d+/g) } $ff =~ /^\s+\/[ab]\.log:(.*)$/mg;
+ok(@log_runs == 2 && !grep({ $_ > 2 } @log_runs), "files appended in turn stay contiguous");
+
+# the io_uring backend with a cache much smaller than the image
+system("(./nufs -o uring,cache=8 -s -f mnt data.nufs 2>&1) >> test.log &");
+sleep 1;
+ok(read_text("40k.txt") eq $huge0, "Read back through the io_uring backend.");
+write_text("uring.txt", $huge0);
+unmount();
+
+system("./nufs-fsck data.nufs > /dev/null");
+ok($? == 0, "fsck is happy with what the io_uring backend wrote");
+
+# with writeback caching lots of small writes reach us as a few big ones
+system("(./nufs -o writeback -s -f mnt data.nufs 2>&1) > writeback.log &");
+sleep 1;
+open(my $wb, '>', 'mnt/writeback.txt');
+my $wb_data = "";
+for my $ii (1..2000) {
+    my $line = sprintf("%05d\n", $ii);
+    syswrite($wb, $line);
+    $wb_data .= $line;
+}
+utime(1000000000, 1000000000, "mnt/writeback.txt");
+close($wb);
+my $wb_ok = read_text("writeback.txt") eq substr($wb_data, 0, -1);
+my $wb_mtime = (stat("mnt/writeback.txt"))[9];
+unmount();
+sleep 1;
+my $wb_writes = () = `cat writeback.log` =~ /^write\(\/writeback\.txt/mg;
+system("cat writeback.log >> test.log && rm -f writeback.log");
+ok($wb_ok && $wb_writes > 0 && $wb_writes < 200, "writeback caching sends small writes in bulk");
+
+mount();
+ok((stat("mnt/writeback.txt"))[9] == 1000000000 && $wb_mtime == 1000000000,
+   "a cached write doesn't undo a modification time set after it");
+unlink("mnt/writeback.txt");
+unmount();
+
+system("(./nufs -o noatime -s -f mnt data.nufs 2>&1) >> test.log &");
+sleep 1;
+write_text("noatime.txt", "read me");
+utime(1000000000, 1000000000, "mnt/noatime.txt");
+read_text("noatime.txt") for 1..2;
+ok((stat("mnt/noatime.txt"))[8] == 1000000000, "-o noatime never updates access times");
+unlink("mnt/noatime.txt");
 unmount();
@@ -0,0 +1,432 @@
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <assert.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#include <linux/io_uring.h>
+
+#include "uring.h"
+#include "sizes.h"
+#include "util.h"
+
+/**
+ * The image is opened O_DIRECT so the only copy of a page in memory
+ * is the one in this cache. Pages are read and written through an
+ * io_uring as many at a time as there are: everything an operation
+ * changed is written back together when it ends, and a prefetch reads
+ * everything it is given together. A page that has been got and not
+ * put yet stays where it is, the cache grows past its size for as
+ * long as that takes and shrinks back as pages are put. Eviction is
+ * LRU-2, the page whose second to last use is furthest back goes
+ * first and pages only used once go before any of those, so reading
+ * through a big file doesn't push out the pages used all the time
+ */
+
+// a page held in the cache
+typedef struct frame {
+    int pnum; // -1 when the frame is empty
+    int pins; // gets not matched by a put yet
+    int dirty; // changed since it was last written
+    int unused; // read ahead of time and not got yet
+    long used[2]; // when it was last got and the time before that
+    uint8_t* data;
+} frame;
+
+static int cache_size = 64;
+static frame* frames = 0; // one per page, enough for all of them pinned
+static int* frame_of = 0; // which frame each page is in, -1 if none
+static int frames_used = 0;
+static long cache_clock = 0;
+
+static int image_fd = -1;
+
+// submissions at a time
+static const int ring_depth = 32;
+
+static int ring_fd = -1;
+static unsigned ring_entries;
+static void* sq_ring;
+static size_t sq_ring_size;
+static void* cq_ring;
+static size_t cq_ring_size;
+static unsigned* sq_tail;
+static unsigned* sq_mask;
+static unsigned* sq_array;
+static struct io_uring_sqe* sqes;
+static unsigned* cq_head;
+static unsigned* cq_tail;
+static unsigned* cq_mask;
+static struct io_uring_cqe* cqes;
+
+void
+uring_set_cache(int pages)
+{
+    cache_size = min(max(pages, 4), num_pages);
+}
+
+static
+void
+ring_init()
+{
+    struct io_uring_params params;
+    memset(&params, 0, sizeof(params));
+    ring_fd = syscall(__NR_io_uring_setup, ring_depth, &params);
+    if(ring_fd < 0) {
+        perror("nufs: io_uring_setup");
+        exit(1);
+    }
+    ring_entries = params.sq_entries;
+
+    sq_ring_size = params.sq_off.array + params.sq_entries * sizeof(unsigned);
+    sq_ring = mmap(0, sq_ring_size, PROT_READ | PROT_WRITE,
+                   MAP_SHARED | MAP_POPULATE, ring_fd, IORING_OFF_SQ_RING);
+    assert(sq_ring != MAP_FAILED);
+    sq_tail = (unsigned*)((char*)sq_ring + params.sq_off.tail);
+    sq_mask = (unsigned*)((char*)sq_ring + params.sq_off.ring_mask);
+    sq_array = (unsigned*)((char*)sq_ring + params.sq_off.array);
+
+    cq_ring_size = params.cq_off.cqes + params.cq_entries * sizeof(struct io_uring_cqe);
+    cq_ring = mmap(0, cq_ring_size, PROT_READ | PROT_WRITE,
+                   MAP_SHARED | MAP_POPULATE, ring_fd, IORING_OFF_CQ_RING);
+    assert(cq_ring != MAP_FAILED);
+    cq_head = (unsigned*)((char*)cq_ring + params.cq_off.head);
+    cq_tail = (unsigned*)((char*)cq_ring + params.cq_off.tail);
+    cq_mask = (unsigned*)((char*)cq_ring + params.cq_off.ring_mask);
+    cqes = (struct io_uring_cqe*)((char*)cq_ring + params.cq_off.cqes);
+
+    sqes = mmap(0, params.sq_entries * sizeof(struct io_uring_sqe), PROT_READ | PROT_WRITE,
+                MAP_SHARED | MAP_POPULATE, ring_fd, IORING_OFF_SQES);
+    assert(sqes != MAP_FAILED);
+}
+
+static
+void
+ring_free()
+{
+    munmap(sqes, ring_entries * sizeof(struct io_uring_sqe));
+    munmap(cq_ring, cq_ring_size);
+    munmap(sq_ring, sq_ring_size);
+    close(ring_fd);
+    ring_fd = -1;
+}
+
+// a page that couldn't be read is left zeroed so it fails its
+// checksum, one that couldn't be written stays dirty
+static
+void
+ring_done(int op, frame* fr, int res)
+{
+    if(op == IORING_OP_WRITE) {
+        if(res == page_size) {
+            fr->dirty = 0;
+            return;
+        }
+        fprintf(stderr, "nufs: writing page %d: %s\n", fr->pnum,
+                res < 0 ? strerror(-res) : "short write");
+        return;
+    }
+
+    if(res < 0) {
+        fprintf(stderr, "nufs: reading page %d: %s\n", fr->pnum, strerror(-res));
+        res = 0;
+    }
+    // past the end of the image
+    memset(fr->data + res, 0, page_size - res);
+}
+
+// reads or writes the pages in the given frames, returning once all
+// of them are done
+static
+void
+ring_io(int op, frame** list, int count)
+{
+    for(int done = 0; done < count; ) {
+        int batch = min(count - done, (int)ring_entries);
+        unsigned tail = *sq_tail;
+        for(int ii = 0; ii < batch; ++ii) {
+            frame* fr = list[done + ii];
+            unsigned idx = (tail + ii) & *sq_mask;
+            struct io_uring_sqe* sqe = &sqes[idx];
+            memset(sqe, 0, sizeof(*sqe));
+            sqe->opcode = op;
+            sqe->fd = image_fd;
+            sqe->addr = (uintptr_t)fr->data;
+            sqe->len = page_size;
+            sqe->off = (uint64_t)fr->pnum * page_size;
+            sqe->user_data = done + ii;
+            sq_array[idx] = idx;
+        }
+        __atomic_store_n(sq_tail, tail + batch, __ATOMIC_RELEASE);
+
+        int submit = batch;
+        int reaped = 0;
+        while(reaped < batch) {
+            int rv = syscall(__NR_io_uring_enter, ring_fd, submit, 1,
+                             IORING_ENTER_GETEVENTS, 0, 0);
+            if(rv > 0) {
+                submit -= rv;
+            }
+            else if(rv < 0 && errno != EINTR) {
+                perror("nufs: io_uring_enter");
+                exit(1);
+            }
+
+            unsigned head = *cq_head;
+            while(head != __atomic_load_n(cq_tail, __ATOMIC_ACQUIRE)) {
+                struct io_uring_cqe* cqe = &cqes[head & *cq_mask];
+                ring_done(op, list[cqe->user_data], cqe->res);
+                head += 1;
+                reaped += 1;
+            }
+            __atomic_store_n(cq_head, head, __ATOMIC_RELEASE);
+        }
+        done += batch;
+    }
+}
+
+// the page in the cache to drop next, 0 if everything is pinned
+static
+frame*
+cache_victim()
+{
+    frame* best = 0;
+    for(int ii = 0; ii < num_pages; ++ii) {
+        frame* fr = &frames[ii];
+        if(fr->pnum < 0 || fr->pins) {
+            continue;
+        }
+        if(!best || fr->used[1] < best->used[1] ||
+           (fr->used[1] == best->used[1] && fr->used[0] < best->used[0])) {
+            best = fr;
+        }
+    }
+    return best;
+}
+
+// drops a page from the cache, writing it out first if it has to be.
+// returns nonzero if it couldn't be written and so has to stay
+static
+int
+cache_evict(frame* fr)
+{
+    if(fr->dirty) {
+        ring_io(IORING_OP_WRITE, &fr, 1);
+        if(fr->dirty) {
+            return -1;
+        }
+    }
+    frame_of[fr->pnum] = -1;
+    fr->pnum = -1;
+    frames_used -= 1;
+    return 0;
+}
+
+// finds a frame for pnum, which isn't in the cache, making room for
+// it if the cache is full
+static
+frame*
+cache_alloc(int pnum)
+{
+    frame* fr = 0;
+    if(frames_used >= cache_size) {
+        fr = cache_victim();
+        if(fr && cache_evict(fr)) {
+            fr = 0;
+        }
+    }
+    // every page could be in the cache at once, so there is always
+    // an empty frame if nothing could be evicted
+    for(int ii = 0; !fr; ++ii) {
+        if(frames[ii].pnum < 0) {
+            fr = &frames[ii];
+        }
+    }
+
+    if(!fr->data) {
+        int rv = posix_memalign((void**)&fr->data, page_size, page_size);
+        assert(rv == 0);
+    }
+    fr->pnum = pnum;
+    fr->pins = 0;
+    fr->dirty = 0;
+    fr->unused = 0;
+    fr->used[0] = 0;
+    fr->used[1] = 0;
+    frame_of[pnum] = fr - frames;
+    frames_used += 1;
+    return fr;
+}
+
+// reads as many of the given pages as the cache has room for that
+// aren't in it already, all at once. 0 entries are skipped
+static
+void
+uring_prefetch(const int* pnums, int count)
+{
+    frame* list[num_pages];
+    int nn = 0;
+    int limit = cache_size / 2;
+    for(int ii = 0; ii < count && nn < limit; ++ii) {
+        int pnum = pnums[ii];
+        if(pnum <= 0 || pnum >= num_pages || frame_of[pnum] >= 0) {
+            continue;
+        }
+        frame* fr = cache_alloc(pnum);
+        // keeps it from being evicted to make room for the rest
+        fr->pins = 1;
+        fr->unused = 1;
+        fr->used[0] = cache_clock;
+        list[nn++] = fr;
+    }
+
+    ring_io(IORING_OP_READ, list, nn);
+    for(int ii = 0; ii < nn; ++ii) {
+        list[ii]->pins = 0;
+    }
+}
+
+static
+void*
+uring_get(int pnum, int fresh)
+{
+    if(pnum < 0 || pnum >= num_pages) {
+        return 0;
+    }
+
+    frame* fr;
+    if(frame_of[pnum] >= 0) {
+        fr = &frames[frame_of[pnum]];
+    }
+    else {
+        fr = cache_alloc(pnum);
+        if(fresh) {
+            memset(fr->data, 0, page_size);
+        }
+        else {
+            ring_io(IORING_OP_READ, &fr, 1);
+        }
+        fr->unused = 1;
+    }
+
+    cache_clock += 1;
+    if(!fr->unused) {
+        fr->used[1] = fr->used[0];
+    }
+    fr->used[0] = cache_clock;
+    fr->unused = 0;
+    fr->pins += 1;
+    return fr->data;
+}
+
+// shrinks the cache back down to its size once pages are let go
+static
+void
+uring_put(int pnum)
+{
+    frame* fr = &frames[frame_of[pnum]];
+    if(fr->pins > 0) {
+        fr->pins -= 1;
+    }
+    while(frames_used > cache_size) {
+        frame* victim = cache_victim();
+        if(!victim || cache_evict(victim)) {
+            break;
+        }
+    }
+}
+
+static
+void
+uring_dirty(int pnum)
+{
+    frames[frame_of[pnum]].dirty = 1;
+}
+
+// writes back every dirty page at once, the ones that couldn't be
+// written stay dirty to be tried again next time
+static
+void
+uring_sync()
+{
+    frame* list[num_pages];
+    int nn = 0;
+    for(int ii = 0; ii < num_pages; ++ii) {
+        if(frames[ii].pnum >= 0 && frames[ii].dirty) {
+            list[nn++] = &frames[ii];
+        }
+    }
+    ring_io(IORING_OP_WRITE, list, nn);
+}
+
+static
+void*
+uring_open(const char* path, int readonly)
+{
+    int flags = readonly ? O_RDONLY : O_CREAT | O_RDWR;
+    image_fd = open(path, flags | O_DIRECT, 0644);
+    if(image_fd == -1 && errno == EINVAL) {
+        // tmpfs for one can't do direct io
+        fprintf(stderr, "nufs: can't open %s O_DIRECT, going through the page cache\n", path);
+        image_fd = open(path, flags, 0644);
+    }
+    assert(image_fd != -1);
+    if(!readonly) {
+        int rv = ftruncate(image_fd, num_pages * page_size);
+        assert(rv == 0);
+    }
+
+    frames = calloc(num_pages, sizeof(frame));
+    frame_of = malloc(num_pages * sizeof(int));
+    for(int ii = 0; ii < num_pages; ++ii) {
+        frames[ii].pnum = -1;
+        frame_of[ii] = -1;
+    }
+    frames_used = 0;
+    ring_init();
+
+    // page 0 is needed for good, and the inode chunks straight away
+    uint8_t* meta = uring_get(0, 0);
+    int* chunks = (int*)(meta + inode_chunks_offset);
+    int pnums[num_inode_chunks];
+    int count = 0;
+    for(int ii = 0; ii < num_inode_chunks; ++ii) {
+        if(chunks[ii] > 0 && chunks[ii] < num_pages) {
+            pnums[count++] = chunks[ii];
+        }
+    }
+    uring_prefetch(pnums, count);
+    return meta;
+}
+
+static
+void
+uring_close()
+{
+    uring_sync();
+    ring_free();
+    close(image_fd);
+    image_fd = -1;
+    for(int ii = 0; ii < num_pages; ++ii) {
+        free(frames[ii].data);
+    }
+    free(frames);
+    free(frame_of);
+    frames = 0;
+}
+
+const pages_backend uring_backend = {
+    .name = "uring",
+    .open = uring_open,
+    .close = uring_close,
+    .get = uring_get,
+    .put = uring_put,
+    .dirty = uring_dirty,
+    .sync = uring_sync,
+    .prefetch = uring_prefetch,
+};
@@ -0,0 +1,13 @@
+#ifndef URING_H
+#define URING_H
+
+#include "pages.h"
+
+// a backend that keeps its own cache of pages and reads and writes
+// the image with io_uring, going around the kernel's page cache
+extern const pages_backend uring_backend;
+
+// how many pages the cache holds on to once nothing needs more
+void uring_set_cache(int pages);
+
+#endif